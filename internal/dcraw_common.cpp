@@ -353,6 +353,41 @@ int CLASS canon_s2is()
   return 0;
 }
 
+#ifdef LIBRAW_LIBRARY_BUILD
+/*
+   Buffered fgetc() for bit readers: input is read by large blocks,
+   so ifp position runs ahead of consumed data and decoder should
+   fseek() before any other ifp access.
+   getbyte_buf(1) drops the buffer, getbyte_buf(0) returns next byte.
+ */
+int CLASS getbyte_buf (int drop)
+{
+#ifndef LIBRAW_NOTHREADS
+#define buf tls->getbyte.buf
+#define pos tls->getbyte.pos
+#define len tls->getbyte.len
+#else
+  static uchar buf[0x4000];
+  static int pos=0, len=0;
+#endif
+  if (drop) return pos = len = 0;
+  if (pos >= len) {
+    pos = 0;
+    if ((len = fread (buf, 1, sizeof buf, ifp)) < 1)
+      return len = EOF;
+  }
+  return buf[pos++];
+#ifndef LIBRAW_NOTHREADS
+#undef buf
+#undef pos
+#undef len
+#endif
+}
+#define getbyte() getbyte_buf(0)
+#else
+#define getbyte() fgetc(ifp)
+#endif
+
 /*
    getbits(-1) initializes the buffer
    getbits(n) where 0 <= n <= 25 returns an n-bit integer
@@ -370,11 +405,15 @@ unsigned CLASS getbithuff (int nbits, ushort *huff)
 #endif
   unsigned c;
 
-  if (nbits == -1)
+  if (nbits == -1) {
+#ifdef LIBRAW_LIBRARY_BUILD
+    getbyte_buf(1);
+#endif
     return bitbuf = vbits = reset = 0;
+  }
   if (nbits == 0 || vbits < 0) return 0;
-  while (!reset && vbits < nbits && (c = fgetc(ifp)) != EOF &&
-    !(reset = zero_after_ff && c == 0xff && fgetc(ifp))) {
+  while (!reset && vbits < nbits && (c = getbyte()) != EOF &&
+    !(reset = zero_after_ff && c == 0xff && getbyte())) {
     bitbuf = (bitbuf << 8) + (uchar) c;
     vbits += 8;
   }
@@ -430,7 +469,11 @@ ushort * CLASS make_decoder_ref (const uchar **source)
 
   count = (*source += 16) - 17;
   for (max=16; max && !count[max]; max--);
+#ifdef LIBRAW_LIBRARY_BUILD
+  huff = (ushort *) calloc (((2 + (1 << max)) & ~1) + 2*(1 << LIBRAW_HUFF_FASTBITS), sizeof *huff);
+#else
   huff = (ushort *) calloc (1 + (1 << max), sizeof *huff);
+#endif
   merror (huff, "make_decoder()");
   huff[0] = max;
   for (h=len=1; len <= max; len++)
@@ -446,6 +489,43 @@ ushort * CLASS make_decoder (const uchar *source)
   return make_decoder_ref (&source);
 }
 
+#ifdef LIBRAW_LIBRARY_BUILD
+/*
+   Fill the direct lookup table behind a make_decoder() table: for every
+   LIBRAW_HUFF_FASTBITS-bit prefix whose code and difference bits both
+   fit, store the decoded diff and the number of bits used.  Differences
+   follow ljpeg_diff() or, with nikon set, nikon_compressed_load_raw().
+ */
+void CLASS make_fast_decoder (ushort *huff, int nikon)
+{
+  const int fb = LIBRAW_HUFF_FASTBITS;
+  unsigned *fast = LIBRAW_HUFF_FAST(huff);
+  int max = huff[0], idx, h, bits, len, shl, nb, diff;
+
+  for (idx=0; idx < 1 << fb; idx++) {
+    fast[idx] = 0;
+    if (!max) continue;
+    h = huff[1 + (max > fb ? idx << (max-fb) : idx >> (fb-max))];
+    if (!(bits = h >> 8)) continue;
+    len = (uchar) h;
+    shl = 0;
+    if (nikon) {
+      shl = len >> 4;
+      len &= 15;
+    }
+    nb = len - shl;
+    if (nb < 0 || bits + nb > fb) continue;
+    diff = idx >> (fb - bits - nb) & ((1 << nb) - 1);
+    if (nikon)
+      diff = ((diff << 1) + 1) << shl >> 1;
+    if (len && (diff & (1 << (len-1))) == 0)
+      diff -= (1 << len) - !shl;
+    if (!len) diff = 0;
+    fast[idx] = (diff & 0xffff) << 16 | (bits + nb);
+  }
+}
+#endif
+
 void CLASS crw_init_tables (unsigned table, ushort *huff[2])
 {
   static const uchar first_tree[3][29] = {
@@ -531,12 +611,49 @@ int CLASS canon_has_lowbits()
   return ret;
 }
 
+#ifdef LIBRAW_LIBRARY_BUILD
+/*
+   The low-order bits of all rows are stored together at offset 26,
+   four pixels per byte.  Read them in one go and merge them into
+   the high bits already decoded into raw_image, rows in parallel.
+ */
+void CLASS canon_load_lowbits()
+{
+  uchar *lowbits;
+  size_t size = ((size_t) raw_height*raw_width + 3) >> 2, got;
+  int row;
+
+  lowbits = (uchar *) malloc (size);
+  merror (lowbits, "canon_load_lowbits()");
+  fseek (ifp, 26, SEEK_SET);
+  got = fread (lowbits, 1, size, ifp);
+  memset (lowbits + got, 0xff, size - got);
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp parallel for schedule(static) default(shared)
+#endif
+  for (row=0; row < raw_height; row++) {
+    size_t pix = (size_t) row*raw_width;
+    ushort *prow = &raw_image[pix];
+    int col, val;
+    for (col=0; col < raw_width; col++, pix++) {
+      val = (prow[col] << 2) + ((lowbits[pix >> 2] >> ((pix & 3) << 1)) & 3);
+      if (raw_width == 2672 && val < 512) val += 2;
+      prow[col] = val;
+    }
+  }
+  free (lowbits);
+}
+#endif
+
 void CLASS canon_compressed_load_raw()
 {
   ushort *pixel, *prow, *huff[2];
-  int nblocks, lowbits, i, c, row, r, col, save, val;
+  int nblocks, lowbits, i, c, row, r, col;
   unsigned irow, icol;
   int block, diffbuf[64], leaf, len, diff, carry=0, pnum=0, base[2];
+#ifndef LIBRAW_LIBRARY_BUILD
+  int save, val;
+#endif
 
   crw_init_tables (tiff_compress, huff);
   pixel = (ushort *) calloc (raw_width*8, sizeof *pixel);
@@ -571,6 +688,7 @@ void CLASS canon_compressed_load_raw()
 	  derror();
       }
     }
+#ifndef LIBRAW_LIBRARY_BUILD
     if (lowbits) {
       save = ftell(ifp);
       fseek (ifp, 26 + row*raw_width/4, SEEK_SET);
@@ -584,15 +702,21 @@ void CLASS canon_compressed_load_raw()
       }
       fseek (ifp, save, SEEK_SET);
     }
+#endif
 
 #ifdef LIBRAW_LIBRARY_BUILD
     for (r=0; r < 8; r++) {
         if(row+r>=raw_height) break; // Not sure that raw_height is always N*8
         // MOVE entire row into place
         memmove(&raw_image[(row+r)*raw_width],&pixel[r*raw_width],raw_width*sizeof(pixel[0]));
-
-        irow = row - top_margin + r;
+    }
+  }
+  // low bits are merged after the Huffman pass, margins are summed after the merge
+  if (lowbits) canon_load_lowbits();
+  for (row=0; row < raw_height; row++) {
+        irow = row - top_margin;
         if (irow >= height) continue; // if row above image area than irow is VERY positive :)
+        prow = &raw_image[row*raw_width];
 
         // only margins!
         for (col=0; col < left_margin; col++) 
@@ -600,14 +724,14 @@ void CLASS canon_compressed_load_raw()
                 icol = col - left_margin;
                 c = FC(irow,icol);
                 if (icol >= width && col > 1 && (unsigned) (col-left_margin+2) > width+3)
-                    cblack[c] += (cblack[4+c]++,pixel[r*raw_width+col]);
+                    cblack[c] += (cblack[4+c]++,prow[col]);
             }
         for (col=width+left_margin; col < raw_width; col++) 
             {
                 icol = col - left_margin;
                 c = FC(irow,icol);
                 if (icol >= width && col > 1 && (unsigned) (col-left_margin+2) > width+3)
-                    cblack[c] += (cblack[4+c]++,pixel[r*raw_width+col]);
+                    cblack[c] += (cblack[4+c]++,prow[col]);
             }
 
     }
@@ -625,14 +749,14 @@ void CLASS canon_compressed_load_raw()
 	  cblack[c] += (cblack[4+c]++,pixel[r*raw_width+col]);
       }
     }
-#endif
   }
+#endif
   free (pixel);
   FORC(2) free (huff[c]);
   FORC4 if (cblack[4+c]) cblack[c] /= cblack[4+c];
 }
 
-#line 934 "dcraw/dcraw.c"
+#line 1058 "dcraw/dcraw.c"
 int CLASS ljpeg_start (struct jhead *jh, int info_only)
 {
   int c, tag, len;
@@ -673,6 +797,9 @@ int CLASS ljpeg_start (struct jhead *jh, int info_only)
     }
   } while (tag != 0xffda);
   if (info_only) return 1;
+#ifdef LIBRAW_LIBRARY_BUILD
+  FORC4 if (jh->free[c]) make_fast_decoder (jh->free[c], 0);
+#endif
   FORC(5) if (!jh->huff[c+1]) jh->huff[c+1] = jh->huff[c];
   if (jh->sraw) {
     FORC(4)        jh->huff[2+c] = jh->huff[1];
@@ -708,7 +835,10 @@ int CLASS ljpeg_diff (ushort *huff)
 int CLASS ljpeg_diff_new (LibRaw_bit_buffer& bits, LibRaw_byte_buffer* buf,ushort *huff)
 {
   int len, diff;
+  unsigned fast;
 
+  if ((fast = bits._getfast_lj(buf,LIBRAW_HUFF_FAST(huff))))
+    return (short) (fast >> 16);
   len = bits._gethuff_lj(buf,*huff,huff+1);
   if (len == 16 && (!dng_version || dng_version >= 0x1010000))
     return -32768;
@@ -721,7 +851,10 @@ int CLASS ljpeg_diff_new (LibRaw_bit_buffer& bits, LibRaw_byte_buffer* buf,ushor
 int CLASS ljpeg_diff_pef (LibRaw_bit_buffer& bits, LibRaw_byte_buffer* buf,ushort *huff)
 {
   int len, diff;
+  unsigned fast;
 
+  if ((fast = bits._getfast(buf,LIBRAW_HUFF_FAST(huff),zero_after_ff)))
+    return (short) (fast >> 16);
   len = bits._gethuff(buf,*huff,huff+1,zero_after_ff);
   if (len == 16 && (!dng_version || dng_version >= 0x1010000))
     return -32768;
@@ -781,15 +914,12 @@ ushort * CLASS ljpeg_row (int jrow, struct jhead *jh)
 ushort * CLASS ljpeg_row_new (int jrow, struct jhead *jh, LibRaw_bit_buffer& bits,LibRaw_byte_buffer* bytes)
 {
   int col, c, diff, pred, spred=0;
-  ushort mark=0, *row[3];
+  ushort *row[3];
 
   if (jrow * jh->wide % jh->restart == 0) {
     FORC(6) jh->vpred[c] = 1 << (jh->bits-1);
-    if (jrow) {
-        bytes->unseek2();
-        do mark = (mark << 8) + (c = bytes->get_byte());
-        while (c != EOF && mark >> 4 != 0xffd);
-    }
+    if (jrow)
+        bytes->ljpeg_restart();
     bits.reset();
   }
   FORC3 row[c] = jh->row + jh->wide*jh->clrs*((jrow+c) & 1);
@@ -810,7 +940,10 @@ ushort * CLASS ljpeg_row_new (int jrow, struct jhead *jh, LibRaw_bit_buffer& bit
 	case 7: pred = (pred + row[1][0]) >> 1;				break;
 	default: pred = 0;
       }
-      if ((**row = pred + diff) >> jh->bits) derror();
+      if ((**row = pred + diff) >> jh->bits) {
+	if (jh->quiet) throw LIBRAW_EXCEPTION_IO_CORRUPT;
+	derror();
+      }
       if (c <= jh->sraw) spred = **row;
       row[0]++; row[1]++;
     }
@@ -819,15 +952,132 @@ ushort * CLASS ljpeg_row_new (int jrow, struct jhead *jh, LibRaw_bit_buffer& bit
 
 #endif
 
+#ifdef LIBRAW_LIBRARY_BUILD
+#ifdef LIBRAW_USE_OPENMP
+/*
+   Restart intervals that begin on a row boundary can be decoded on
+   their own, as long as the predictor does not look at the row above
+   (psv 1).  Returns the number of intervals and, in pos, the offsets of
+   the markers that open them; 0 if the scan is decoded serially.
+ */
+int CLASS ljpeg_intervals (struct jhead *jh, LibRaw_byte_buffer *buf, unsigned **pos)
+{
+  int rows, count;
+
+  if (data_error || omp_get_max_threads() < 2 || jh->psv != 1 || jh->wide < 1
+      || jh->restart < 1 || jh->restart == INT_MAX || jh->restart % jh->wide)
+    return 0;
+  rows = jh->restart / jh->wide;
+  if ((count = (jh->high + rows - 1) / rows) < 2) return 0;
+  *pos = (unsigned *) malloc (count * sizeof **pos);
+  merror (*pos, "ljpeg_intervals()");
+  buf->ljpeg_restarts (*pos, count);
+  return count;
+}
+#endif
+
+/*
+   Add raw_image pixels first..last-1 (vp[0] is pixel first) to the
+   per-color border sums and counts in cb and, if min is set, to the
+   minimum of the visible area.
+ */
+void CLASS lossless_jpeg_stats (const ushort *vp, unsigned first, unsigned last,
+                                int *min, unsigned *cb)
+{
+  int row, col, cend, c;
+
+  for (vp -= first; first < last; first += cend - col) {
+    row = first / raw_width;
+    col = first % raw_width;
+    cend = MIN (last - first + col, (unsigned) raw_width);
+    if ((unsigned) (row-top_margin) >= height) continue;
+    const ushort *rp = vp + first - col;
+    int c0 = MAX (col, left_margin), c1 = MIN (cend, left_margin+width);
+    if (min)
+      for (c=c0; c < c1; c++)
+        if (*min > rp[c]) *min = rp[c];
+    // the same border as (col > 1 && (unsigned) (col-left_margin+2) > width+3)
+    for (c0=MAX(col,2), c1=MIN(cend,left_margin-2); c0 < c1; c0++) {
+      c = FC(row-top_margin,c0-left_margin);
+      cb[c] += (cb[4+c]++,rp[c0]);
+    }
+    for (c0=MAX(col,left_margin+width+2); c0 < cend; c0++) {
+      c = FC(row-top_margin,c0-left_margin);
+      cb[c] += (cb[4+c]++,rp[c0]);
+    }
+  }
+}
+
+/*
+   Decode rows jrow..jend-1 and store them through the CR2 slice table,
+   one contiguous span of a slice at a time.  pix holds the running
+   position (pixel number, pixels left in the slice, next slice).
+   Border sums and counts go to cb, unless cb is null and the caller
+   collects them from raw_image with lossless_jpeg_stats().
+ */
+void CLASS lossless_jpeg_rows (struct jhead *jh, LibRaw_byte_buffer *buf, int jrow, int jend,
+                               unsigned *pix, const unsigned *offset, const unsigned *slicesW,
+                               int *min, unsigned *cb)
+{
+  int jwide = jh->wide * jh->clrs, jcol;
+  unsigned total = raw_width*raw_height, dst, n, m;
+  ushort *rp, *vp, *vbuf=0;
+  LibRaw_bit_buffer bits;
+
+  if (jh->bits <= 12) {
+    vbuf = (ushort *) malloc (jwide * sizeof *vbuf);
+    merror (vbuf, "lossless_jpeg_rows()");
+  }
+  for (; jrow < jend; jrow++) {
+    rp = ljpeg_row_new (jrow, jh, bits, buf);
+    if (vbuf) {
+      for (jcol=0; jcol < jwide; jcol++)
+        vbuf[jcol] = curve[rp[jcol] & 0xfff];
+      rp = vbuf;
+    }
+    for (jcol=0; jcol < jwide; jcol += n, rp += n) {
+      n = MIN (pix[1], (unsigned) (jwide - jcol));
+      dst = pix[0];
+      pix[0] += n;
+      if (0 == (pix[1] -= n))
+          {
+              unsigned o = offset[pix[2]++];
+              pix[0] = o & 0x0fffffff;
+              pix[1] = slicesW[o>>28];
+          }
+      vp = rp;
+      m = n;
+      if (raw_width == 3984)
+          {
+              // shifted left by two pixels, wrapping to the row above
+              if (dst < 2) {
+                if (m <= 2 - dst) continue;
+                vp += 2 - dst;
+                m -= 2 - dst;
+                dst = 2;
+              }
+              dst -= 2;
+          }
+      if (dst >= total) continue;
+      if (m > total - dst) m = total - dst;
+      memmove (&raw_image[dst], vp, m * sizeof *vp);
+      if (cb)
+        lossless_jpeg_stats (vp, dst, dst + m, min, cb);
+    }
+  }
+  free (vbuf);
+}
+#endif
+
 void CLASS lossless_jpeg_load_raw()
 {
-  int jwide, jrow, jcol, val, c, i, row=0, col=0;
+  int jwide, c, i;
 #ifndef LIBRAW_LIBRARY_BUILD
-  int jidx,j;
+  int jrow, jcol, val, row=0, col=0, jidx, j;
+  ushort *rp;
 #endif
   struct jhead jh;
   int min=INT_MAX;
-  ushort *rp;
 #ifdef LIBRAW_LIBRARY_BUILD
   int save_min = 0;
   unsigned slicesW[16],slicesWcnt=0,slices;
@@ -868,7 +1118,7 @@ void CLASS lossless_jpeg_load_raw()
   for(slice=0;slice<slices;slice++)
       {
           offset[slice] = (t_x + t_y * raw_width)| (t_s<<28);
-          if(offset[slice] & 0x0fffffff >= raw_width * raw_height)
+          if((offset[slice] & 0x0fffffff) >= raw_width * raw_height || !slicesW[t_s])
               throw LIBRAW_EXCEPTION_IO_BADFILE; 
           t_y++;
           if(t_y == jh.high)
@@ -878,6 +1128,9 @@ void CLASS lossless_jpeg_load_raw()
               }
       }
   offset[slices] = offset[slices-1];
+  // more pixels than the slices (plus the repeated last one) hold would run past offset[]
+  if ((INT64) jwide * jh.high >= (INT64) t_x * jh.high + slicesW[slicesWcnt-1])
+      throw LIBRAW_EXCEPTION_IO_BADFILE;
   slice = 1; // next slice
   pixno = offset[0];
   pixelsInSlice = slicesW[0];
@@ -887,21 +1140,107 @@ void CLASS lossless_jpeg_load_raw()
   if(!data_size)
       throw LIBRAW_EXCEPTION_IO_BADFILE;
   LibRaw_byte_buffer *buf = ifp->make_byte_buffer(data_size);
-  LibRaw_bit_buffer bits;
+  unsigned pix[3] = { pixno, pixelsInSlice, slice }, cb[8] = {0,0,0,0,0,0,0,0};
+  int done = 0;
+  // slices that tile whole raw rows get border sums from raw_image afterwards
+  int tiled = (unsigned) jwide == t_x && t_x == raw_width && jh.high <= raw_height;
+#ifdef LIBRAW_USE_OPENMP
+  unsigned *ipos, (*ipix)[3];
+  int nint = 0, rows, failed = 0;
+  // the interval start positions are only known if the slices hold exactly the scan
+  if ((unsigned) jwide == t_x)
+    nint = ljpeg_intervals (&jh, buf, &ipos);
+  if (nint)
+    {
+      rows = jh.restart / jh.wide;
+      ipix = (unsigned (*)[3]) malloc (nint * sizeof *ipix);
+      merror (ipix, "lossless_jpeg_load_raw()");
+      for (i=0; i < nint; i++)
+        {
+          memmove (ipix[i], pix, sizeof pix);
+          if (i+1 < nint)
+            for (unsigned n = jwide * rows; n; )
+              {
+                if (n >= pix[1])
+                  {
+                    n -= pix[1];
+                    unsigned o = offset[pix[2]++];
+                    pix[0] = o & 0x0fffffff;
+                    pix[1] = slicesW[o>>28];
+                  }
+                else
+                  {
+                    pix[0] += n;
+                    pix[1] -= n;
+                    n = 0;
+                  }
+              }
+        }
+      memmove (pix, ipix[0], sizeof pix);
+      // errors are reported by the serial pass, not from the workers
+#pragma omp parallel default(shared) private(c)
+      {
+        struct jhead jt = jh;
+        LibRaw_byte_buffer tb;
+        int tmin = INT_MAX, k;
+        jt.quiet = 1;
+        unsigned tpix[3], tcb[8] = {0,0,0,0,0,0,0,0};
+        if (!(jt.row = (ushort *) calloc (jh.wide*jh.clrs, 4)))
+          {
+#pragma omp critical
+            failed = 1;
+          }
+#pragma omp for schedule(dynamic)
+        for (k=0; k < nint; k++)
+          {
+            if (!jt.row) continue;
+            memmove (tpix, ipix[k], sizeof tpix);
+            tb.set_buffer (buf, ipos[k]);
+            try {
+              lossless_jpeg_rows (&jt, &tb, k*rows, MIN(jh.high,(k+1)*rows), tpix,
+                                  offset, slicesW, save_min ? &tmin : 0, tiled ? 0 : tcb);
+            } catch (...) {
+#pragma omp critical
+              {
+                failed = 1;
+              }
+            }
+          }
+#pragma omp critical
+        {
+          if (tmin < min) min = tmin;
+          FORC(8) cb[c] += tcb[c];
+        }
+        free (jt.row);
+      }
+      free (ipix);
+      free (ipos);
+      if (!(done = !failed))
+        {
+          min = INT_MAX;
+          FORC(8) cb[c] = 0;
+        }
+    }
 #endif
-  for (jrow=0; jrow < jh.high; jrow++) {
-#ifdef LIBRAW_LIBRARY_BUILD
-      rp = ljpeg_row_new (jrow, &jh,bits,buf);
+  if (!done)
+    lossless_jpeg_rows (&jh, buf, 0, jh.high, pix, offset, slicesW, save_min ? &min : 0, tiled ? 0 : cb);
+  if (tiled)
+    lossless_jpeg_stats (raw_image, 0, jh.high*raw_width - (raw_width == 3984 ? 2 : 0),
+                         save_min ? &min : 0, cb);
+  FORC4
+    {
+      cblack[c] += cb[c];
+      cblack[4+c] += cb[4+c];
+    }
 #else
+  for (jrow=0; jrow < jh.high; jrow++) {
     rp = ljpeg_row (jrow, &jh);
-#endif
     if (load_flags & 1)
       row = jrow & 1 ? height-1-jrow/2 : jrow/2;
     for (jcol=0; jcol < jwide; jcol++) {
       val = *rp++;
       if (jh.bits <= 12)
 	val = curve[val & 0xfff];
-#ifndef LIBRAW_LIBRARY_BUILD
       if (cr2_slice[0]) {
 	jidx = jrow*jwide + jcol;
 	i = jidx / (cr2_slice[1]*jh.high);
@@ -911,19 +1250,6 @@ void CLASS lossless_jpeg_load_raw()
 	row = jidx / cr2_slice[1+j];
 	col = jidx % cr2_slice[1+j] + i*cr2_slice[1];
       }
-#else
-      row = pixno/raw_width;
-//      col = pixno-(row*raw_width);
-      col = pixno % raw_width;
-      pixno++;
-      if (0 == --pixelsInSlice)
-          {
-              unsigned o = offset[slice++];
-              pixno = o & 0x0fffffff;
-              pixelsInSlice = slicesW[o>>28];
-          }
-#endif
-#ifndef LIBRAW_LIBRARY_BUILD
 
       if (raw_width == 3984 && (col -= 2) < 0)
               col += (row--,raw_width);
@@ -936,40 +1262,12 @@ void CLASS lossless_jpeg_load_raw()
 	} else if (col > 1 && (unsigned) (col-left_margin+2) > width+3)
 	  cblack[c] += (cblack[4+c]++,val);
       }
-#else
-      if (raw_width == 3984)
-          {
-              if ( (col -= 2) < 0)
-                  col += (row--,raw_width);
-              if(row >= 0 && row < raw_height && col >= 0 && col < raw_width)
-                  RBAYER(row,col) = val;
-          }
-      else 
-                  RBAYER(row,col) = val;
-
-      if ((unsigned) (row-top_margin) < height) 
-          {
-              // within image height
-              if ((unsigned) (col-left_margin) < width) 
-                  {
-                      // within image area, save min
-                      if(save_min)
-                          if (min > val) min = val;
-                  } 
-              else if (col > 1 && (unsigned) (col-left_margin+2) > width+3) 
-                  {
-                      c = FC(row-top_margin,col-left_margin);
-                      cblack[c] += (cblack[4+c]++,val);
-                  }
-          }
-#endif
 
-#ifndef LIBRAW_LIBRARY_BUILD
       if (++col >= raw_width)
 	col = (row++,0);
-#endif
     }
   }
+#endif
   ljpeg_end (&jh);
   FORC4 if (cblack[4+c]) cblack[c] /= cblack[4+c];
   if (!strcasecmp(make,"KODAK"))
@@ -984,7 +1282,7 @@ void CLASS canon_sraw_load_raw()
 {
   struct jhead jh;
   short *rp=0, (*ip)[4];
-  int jwide, slice, scol, ecol, row, col, jrow=0, jcol=0, pix[3], c;
+  int jwide, slice, scol, ecol, row, col, jrow=0, jcol=0, c;
   int v[3]={0,0,0}, ver, hue;
   char *cp;
 
@@ -1027,34 +1325,66 @@ void CLASS canon_sraw_load_raw()
   if (unique_id >= 0x80000281 || (unique_id == 0x80000218 && ver > 1000006))
     hue = jh.sraw << 1;
   ip = (short (*)[4]) image;
-  rp = ip[0];
-  for (row=0; row < height; row++, ip+=width) {
-    if (row & (jh.sraw >> 1))
-      for (col=0; col < width; col+=2)
-	for (c=1; c < 3; c++)
-	  if (row == height-1)
-	       ip[col][c] =  ip[col-width][c];
-	  else ip[col][c] = (ip[col-width][c] + ip[col+width][c] + 1) >> 1;
-    for (col=1; col < width; col+=2)
-      for (c=1; c < 3; c++)
-	if (col == width-1)
-	     ip[col][c] =  ip[col-1][c];
-	else ip[col][c] = (ip[col-1][c] + ip[col+1][c] + 1) >> 1;
-  }
-  for ( ; rp < ip[0]; rp+=4) {
-    if (unique_id < 0x80000218) {
-      pix[0] = rp[0] + rp[2] - 512;
-      pix[2] = rp[0] + rp[1] - 512;
-      pix[1] = rp[0] + ((-778*rp[1] - (rp[2] << 11)) >> 12) - 512;
-    } else {
-      rp[1] = (rp[1] << 2) + hue;
-      rp[2] = (rp[2] << 2) + hue;
-      pix[0] = rp[0] + ((   50*rp[1] + 22929*rp[2]) >> 14);
-      pix[1] = rp[0] + ((-5640*rp[1] - 11751*rp[2]) >> 14);
-      pix[2] = rp[0] + ((29040*rp[1] -   101*rp[2]) >> 14);
+  /*
+     Chroma rows only read the even columns of the rows next to them,
+     which are never written, so this pass can go row by row in parallel.
+   */
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp parallel for schedule(static) default(shared) private(col)
+#endif
+  for (row=0; row < height; row++) {
+    short (*rip)[4] = ip + row*width, (*up)[4] = rip - width, (*dn)[4] = rip + width;
+    if (row & (jh.sraw >> 1)) {
+      if (row == height-1)
+	for (col=0; col < width; col+=2) {
+	  rip[col][1] = up[col][1];
+	  rip[col][2] = up[col][2];
+	}
+      else
+	for (col=0; col < width; col+=2) {
+	  rip[col][1] = (up[col][1] + dn[col][1] + 1) >> 1;
+	  rip[col][2] = (up[col][2] + dn[col][2] + 1) >> 1;
+	}
     }
-    FORC3 
-        rp[c] = CLIP(pix[c] * sraw_mul[c] >> 10);
+    for (col=1; col < width-1; col+=2) {
+      rip[col][1] = (rip[col-1][1] + rip[col+1][1] + 1) >> 1;
+      rip[col][2] = (rip[col-1][2] + rip[col+1][2] + 1) >> 1;
+    }
+    if (col == width-1) {
+      rip[col][1] = rip[col-1][1];
+      rip[col][2] = rip[col-1][2];
+    }
+  }
+  /* YCbCr to RGB, integer only, so every pixel is converted on its own */
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp parallel for schedule(static) default(shared) private(col)
+#endif
+  for (row=0; row < height; row++) {
+    short (*rip)[4] = ip + row*width;
+    int y, cb, cr, r, g, b;
+    if (unique_id < 0x80000218)
+      for (col=0; col < width; col++) {
+	y = rip[col][0];  cb = rip[col][1];  cr = rip[col][2];
+	r = y + cr - 512;
+	g = y + ((-778*cb - (cr << 11)) >> 12) - 512;
+	b = y + cb - 512;
+	rip[col][0] = CLIP(r * sraw_mul[0] >> 10);
+	rip[col][1] = CLIP(g * sraw_mul[1] >> 10);
+	rip[col][2] = CLIP(b * sraw_mul[2] >> 10);
+      }
+    else
+      for (col=0; col < width; col++) {
+	y = rip[col][0];
+	// the shifted chroma is kept as short, as dcraw stores it back first
+	cb = (short) ((rip[col][1] << 2) + hue);
+	cr = (short) ((rip[col][2] << 2) + hue);
+	r = y + ((   50*cb + 22929*cr) >> 14);
+	g = y + ((-5640*cb - 11751*cr) >> 14);
+	b = y + ((29040*cb -   101*cr) >> 14);
+	rip[col][0] = CLIP(r * sraw_mul[0] >> 10);
+	rip[col][1] = CLIP(g * sraw_mul[1] >> 10);
+	rip[col][2] = CLIP(b * sraw_mul[2] >> 10);
+      }
   }
 #ifdef LIBRAW_LIBRARY_BUILD
   delete buf;
@@ -1103,11 +1433,181 @@ void CLASS adobe_copy_pixel (int row, int col, ushort **rp)
 
 }
 
+#ifdef LIBRAW_LIBRARY_BUILD
+/* Decode rows jrow..jend-1 of a DNG tile, row/col is where jrow starts */
+void CLASS adobe_dng_lj_rows (struct jhead *jh, LibRaw_byte_buffer *buf, unsigned jrow, unsigned jend,
+                              unsigned trow, unsigned tcol, unsigned jwide, unsigned row, unsigned col)
+{
+  LibRaw_bit_buffer bits;
+  unsigned jcol;
+  ushort *rp;
+
+  for (; jrow < jend; jrow++) {
+    rp = ljpeg_row_new (jrow, jh, bits, buf);
+    for (jcol=0; jcol < jwide; jcol++) {
+      adobe_copy_pixel (trow+row, tcol+col, &rp);
+      if (++col >= tile_width || col >= raw_width)
+        row += 1 + (col = 0);
+    }
+  }
+}
+
+#ifdef LIBRAW_USE_OPENMP
+/*
+   Decode the restart intervals of one DNG tile in parallel.  Returns 0
+   if the tile has to be decoded serially, also after a decoding error
+   so that the serial pass reports it.
+ */
+int CLASS adobe_dng_lj_intervals (struct jhead *jh, LibRaw_byte_buffer *buf,
+                                  unsigned trow, unsigned tcol, unsigned jwide)
+{
+  unsigned *ipos, wrap = MIN(tile_width, raw_width);
+  int nint, rows, failed = 0;
+
+  if (!wrap || !(nint = ljpeg_intervals (jh, buf, &ipos))) return 0;
+  rows = jh->restart / jh->wide;
+#pragma omp parallel default(shared)
+  {
+    struct jhead jt = *jh;
+    LibRaw_byte_buffer tb;
+    unsigned jrow;
+    int k;
+    jt.quiet = 1;
+    if (!(jt.row = (ushort *) calloc (jh->wide*jh->clrs, 4)))
+      {
+#pragma omp critical
+        failed = 1;
+      }
+#pragma omp for schedule(dynamic)
+    for (k=0; k < nint; k++)
+      {
+        if (!jt.row) continue;
+        tb.set_buffer (buf, ipos[k]);
+        jrow = k*rows;
+        try {
+          adobe_dng_lj_rows (&jt, &tb, jrow, MIN(jh->high,(k+1)*rows), trow, tcol, jwide,
+                             jrow * jwide / wrap, jrow * jwide % wrap);
+        } catch (...) {
+#pragma omp critical
+          {
+            failed = 1;
+          }
+        }
+      }
+    free (jt.row);
+  }
+  free (ipos);
+  return !failed;
+}
+
+/*
+   Tiled DNG: the tile offsets are read up front, then tile headers are
+   parsed serially and the tiles decoded in parallel, a batch at a time
+   to bound the number of tile buffers held.  A tile that fails is
+   decoded again serially, after the tiles before it, to report the error.
+ */
+void CLASS adobe_dng_lj_tiles()
+{
+  unsigned across, ntiles, nb, *toff, *jwide, wrap = MIN(tile_width, raw_width);
+  int batch = 4 * omp_get_max_threads(), b, t, i, stop = 0, serial, *failed;
+  struct jhead *jh;
+  LibRaw_byte_buffer **bufs;
+
+  across = (raw_width + tile_width - 1) / tile_width;
+  ntiles = across * ((raw_height + tile_length - 1) / tile_length);
+  toff = (unsigned *) calloc (ntiles, sizeof *toff);
+  merror (toff, "adobe_dng_lj_tiles()");
+  for (t=0; t < (int) ntiles; t++)
+    toff[t] = get4();
+  jh = (struct jhead *) calloc (batch, sizeof *jh);
+  bufs = (LibRaw_byte_buffer **) calloc (batch, sizeof *bufs);
+  jwide = (unsigned *) calloc (batch, sizeof *jwide);
+  failed = (int *) calloc (batch, sizeof *failed);
+  if (!jh || !bufs || !jwide || !failed) {
+    free (jh);  free (bufs);  free (jwide);  free (failed);  free (toff);
+    merror (0, "adobe_dng_lj_tiles()");
+  }
+
+  for (b=0; b < (int) ntiles && !stop; b += nb) {
+    nb = MIN(batch, (int) ntiles - b);
+    serial = 0;
+    for (t=0; t < (int) nb; t++) {
+      fseek (ifp, toff[b+t], SEEK_SET);
+      if (!ljpeg_start (&jh[t], 0)) {
+        stop = 1;
+        nb = t;
+        break;
+      }
+      jwide[t] = jh[t].wide;
+      if (filters) jwide[t] *= jh[t].clrs;
+      jwide[t] /= is_raw;
+      // tiles overflowing their rectangle overlap, their order matters
+      if ((jh[t].high * jwide[t] + wrap - 1) / wrap > tile_length)
+        serial = 1;
+      if(!data_size) {
+        for (i=0; i <= t; i++) {
+          ljpeg_end (&jh[i]);
+          if (i < t) delete bufs[i];
+        }
+        free (jh);  free (bufs);  free (jwide);  free (failed);  free (toff);
+        throw LIBRAW_EXCEPTION_IO_BADFILE;
+      }
+      bufs[t] = ifp->make_byte_buffer(data_size);
+    }
+    // an overlapping tile sends the whole batch to the ordered pass
+    for (t=0; t < (int) nb; t++)
+      failed[t] = serial;
+    if (!serial) {
+#pragma omp parallel for default(shared) schedule(dynamic)
+      for (t=0; t < (int) nb; t++)
+        try {
+          jh[t].quiet = 1;
+          adobe_dng_lj_rows (&jh[t], bufs[t], 0, jh[t].high, (b+t) / across * tile_length,
+                             (b+t) % across * tile_width, jwide[t], 0, 0);
+        } catch (...) {
+          failed[t] = 1;
+        }
+    }
+    for (t=0; t < (int) nb; t++) {
+      jh[t].quiet = 0;
+      if (failed[t])
+        try {
+          LibRaw_byte_buffer tb;
+          tb.set_buffer (bufs[t], 0);
+          adobe_dng_lj_rows (&jh[t], &tb, 0, jh[t].high, (b+t) / across * tile_length,
+                             (b+t) % across * tile_width, jwide[t], 0, 0);
+        } catch (...) {
+          for (; t < (int) nb; t++) {
+            ljpeg_end (&jh[t]);
+            delete bufs[t];
+          }
+          free (jh);  free (bufs);  free (jwide);  free (failed);  free (toff);
+          throw;
+        }
+      ljpeg_end (&jh[t]);
+      delete bufs[t];
+    }
+  }
+  free (jh);  free (bufs);  free (jwide);  free (failed);  free (toff);
+}
+#endif
+#endif
+
 void CLASS adobe_dng_load_raw_lj()
 {
-  unsigned save, trow=0, tcol=0, jwide, jrow, jcol, row, col;
+  unsigned save, trow=0, tcol=0, jwide;
   struct jhead jh;
+#ifndef LIBRAW_LIBRARY_BUILD
+  unsigned jrow, jcol, row, col;
   ushort *rp;
+#endif
+#ifdef LIBRAW_USE_OPENMP
+  if (tile_length < INT_MAX && tile_width && !data_error && omp_get_max_threads() > 1)
+    {
+      adobe_dng_lj_tiles();
+      return;
+    }
+#endif
   while (trow < raw_height) {
     save = ftell(ifp);
     if (tile_length < INT_MAX)
@@ -1120,20 +1620,22 @@ void CLASS adobe_dng_load_raw_lj()
     if(!data_size)
         throw LIBRAW_EXCEPTION_IO_BADFILE;
     LibRaw_byte_buffer *buf = ifp->make_byte_buffer(data_size);
-    LibRaw_bit_buffer bits;
 #endif
-    for (row=col=jrow=0; jrow < jh.high; jrow++) {
 #ifdef LIBRAW_LIBRARY_BUILD
-        rp = ljpeg_row_new (jrow, &jh,bits,buf);
-#else
-        rp = ljpeg_row (jrow, &jh);
+#ifdef LIBRAW_USE_OPENMP
+    if (!adobe_dng_lj_intervals (&jh, buf, trow, tcol, jwide))
 #endif
+      adobe_dng_lj_rows (&jh, buf, 0, jh.high, trow, tcol, jwide, 0, 0);
+#else
+    for (row=col=jrow=0; jrow < jh.high; jrow++) {
+      rp = ljpeg_row (jrow, &jh);
       for (jcol=0; jcol < jwide; jcol++) {
 	adobe_copy_pixel (trow+row, tcol+col, &rp);
 	if (++col >= tile_width || col >= raw_width)
 	  row += 1 + (col = 0);
       }
     }
+#endif
     fseek (ifp, save+4, SEEK_SET);
     if ((tcol += tile_width) >= raw_width)
       trow += tile_length + (tcol = 0);
@@ -1161,6 +1663,53 @@ void CLASS adobe_dng_load_raw_nc()
           buf = ifp->make_byte_buffer(dsz);
       }
   LibRaw_bit_buffer bits;
+#ifdef LIBRAW_USE_OPENMP
+  // rows start at byte boundaries, so without 0xFF stuffing they
+  // can be unpacked independently; any error restarts serially
+  if (buf && !zero_after_ff && omp_get_max_threads() > 1)
+    {
+      unsigned rowbytes = (raw_width * tiff_samples * tiff_bps + 7) / 8;
+      int failed = 0;
+#pragma omp parallel default(shared)
+      {
+        ushort *tpix = (ushort *) calloc (raw_width * tiff_samples, sizeof *tpix), *trp;
+        LibRaw_byte_buffer tb;
+        LibRaw_bit_buffer tbits;
+        int trow, tcol;
+        if (!tpix)
+          {
+#pragma omp critical
+            failed = 1;
+          }
+#pragma omp for schedule(static)
+        for (trow=0; trow < raw_height; trow++)
+          {
+            if (!tpix || failed) continue;
+            tbits.reset();
+            tb.set_buffer (buf, trow * rowbytes);
+            try {
+              for (tcol=0; tcol < raw_width * tiff_samples; tcol++)
+                tpix[tcol] = tbits._getbits (&tb, tiff_bps, 0);
+            } catch (...) {
+#pragma omp critical
+              {
+                failed = 1;
+              }
+              continue;
+            }
+            for (trp=tpix, tcol=0; tcol < raw_width; tcol++)
+              adobe_copy_pixel (trow, tcol, &trp);
+          }
+        free (tpix);
+      }
+      if (!failed)
+        {
+          free (pixel);
+          delete buf;
+          return;
+        }
+    }
+#endif
 #endif
 
   for (row=0; row < raw_height; row++) {
@@ -1190,7 +1739,12 @@ void CLASS adobe_dng_load_raw_nc()
 
 void CLASS pentax_load_raw()
 {
+#ifdef LIBRAW_LIBRARY_BUILD
+  unsigned hbuf[(4098 >> 1) + (1 << LIBRAW_HUFF_FASTBITS)];
+  ushort bit[2][15], *huff = (ushort *) hbuf;
+#else
   ushort bit[2][15], huff[4097];
+#endif
   int dep, row, col, diff, c, i;
   ushort vpred[2][2] = {{0,0},{0,0}}, hpred[2];
 
@@ -1205,6 +1759,7 @@ void CLASS pentax_load_raw()
   huff[0] = 12;
   fseek (ifp, data_offset, SEEK_SET);
 #ifdef LIBRAW_LIBRARY_BUILD
+  make_fast_decoder (huff, 0);
   if(!data_size)
       throw LIBRAW_EXCEPTION_IO_BADFILE;
   LibRaw_byte_buffer *buf = ifp->make_byte_buffer(data_size);
@@ -1292,6 +1847,7 @@ void CLASS nikon_compressed_load_raw()
   huff = make_decoder (nikon_tree[tree]);
   fseek (ifp, data_offset, SEEK_SET);
 #ifdef LIBRAW_LIBRARY_BUILD
+  make_fast_decoder (huff, 1);
   if(!data_size)
       throw LIBRAW_EXCEPTION_IO_BADFILE;
   LibRaw_byte_buffer *buf = ifp->make_byte_buffer(data_size);
@@ -1304,23 +1860,31 @@ void CLASS nikon_compressed_load_raw()
     if (split && row == split) {
       free (huff);
       huff = make_decoder (nikon_tree[tree+1]);
+#ifdef LIBRAW_LIBRARY_BUILD
+      make_fast_decoder (huff, 1);
+#endif
       max += (min = 16) << 1;
     }
     for (col=0; col < raw_width; col++) {
 #ifdef LIBRAW_LIBRARY_BUILD
+      if ((i = bits._getfast(buf,LIBRAW_HUFF_FAST(huff),zero_after_ff)))
+        diff = (short) (i >> 16);
+      else {
         i = bits._gethuff(buf,*huff,huff+1,zero_after_ff);
+        len = i & 15;
+        shl = i >> 4;
+        diff = ((bits._getbits(buf,len-shl,zero_after_ff) << 1) + 1) << shl >> 1;
+        if ((diff & (1 << (len-1))) == 0)
+          diff -= (1 << len) - !shl;
+      }
 #else
       i = gethuff(huff);
-#endif
       len = i & 15;
       shl = i >> 4;
-#ifdef LIBRAW_LIBRARY_BUILD
-      diff = ((bits._getbits(buf,len-shl,zero_after_ff) << 1) + 1) << shl >> 1;
-#else
       diff = ((getbits(len-shl) << 1) + 1) << shl >> 1;
-#endif
       if ((diff & (1 << (len-1))) == 0)
 	diff -= (1 << len) - !shl;
+#endif
       if (col < 2) hpred[col] = vpred[row & 1][col] += diff;
       else	   hpred[col & 1] += diff;
       if ((ushort)(hpred[col & 1] + min) >= max) derror();
@@ -1464,7 +2028,7 @@ void CLASS fuji_load_raw()
   read_shorts(raw_image,raw_width*raw_height);
 #endif
 }
-#line 1770 "dcraw/dcraw.c"
+#line 2334 "dcraw/dcraw.c"
 void CLASS ppm_thumb()
 {
   char *thumb;
@@ -1798,6 +2362,111 @@ unsigned CLASS ph1_bithuff (int nbits, ushort *huff)
 #define ph1_bits(n) ph1_bithuff(n,0)
 #define ph1_huff(h) ph1_bithuff(*h,h+1)
 
+#ifdef LIBRAW_LIBRARY_BUILD
+/*
+   Read one row at offset and decode it from memory; past the end of
+   file the row is padded with 0xff like get4() does.  len[] holds the
+   code lengths left by the row above (0 if unknown) and is updated to
+   the lengths at the end of this row.  Returns 1 on success, 2 if an
+   unknown length is needed, 0 where the serial decoder would fail.
+ */
+int CLASS phase_one_load_row_c (uchar *buf, unsigned size, INT64 offset, int row, int *len)
+{
+  static const int length[] = { 8,7,6,9,11,10,5,12,14,13 };
+  int pred[2] = { 0,0 }, vbits=0, got, col, i, j;
+  unsigned pos=0;
+  UINT64 bitbuf=0;
+  ushort pix;
+
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp critical(libraw_read_at)
+#endif
+  got = ifp->read_at (offset, buf, size);
+  if (got < 0) got = 0;
+  memset (buf + got, 0xff, size - got);
+#define ph1b(n) (vbits < (n) ? (bitbuf = bitbuf << 32 | sget4(buf+pos), pos += 4, vbits += 32) : 0, \
+	vbits -= (n), (unsigned) (bitbuf << (64-vbits-(n)) >> (64-(n))))
+  for (col=0; col < raw_width; col++) {
+    if (col >= (raw_width & -8))
+      len[0] = len[1] = 14;
+    else if ((col & 7) == 0)
+      for (i=0; i < 2; i++) {
+	for (j=0; j < 5 && !ph1b(1); j++);
+	if (j--) len[i] = length[j*2 + ph1b(1)];
+      }
+    if (!(i = len[col & 1])) return 2;
+    if (i == 14)
+      pix = pred[col & 1] = ph1b(16);
+    else
+      pix = pred[col & 1] += ph1b(i) + 1 - (1 << (i - 1));
+    if (pred[col & 1] >> 16) return 0;
+    if (ph1.format == 5 && pix < 256)
+      pix = curve[pix];
+    RBAYER(row,col) = pix << 2;
+  }
+#undef ph1b
+  return 1;
+}
+
+/*
+   Every row starts at its own offset.  Rows are first decoded in
+   parallel with unknown code lengths; rows that need the lengths left
+   by the row above are then redone in order.  Returns the first row for
+   the serial decoder (raw_height if none) and its lengths in len[].
+ */
+int CLASS phase_one_load_rows_c (int *offset, int *len)
+{
+  unsigned maxrow = (raw_width*16 + (raw_width/8 + 1)*12) / 8 + 16;
+  int row, i, seed[2];
+  char *status = (char *) calloc (raw_height, 1);
+  int (*last)[2] = (int (*)[2]) calloc (raw_height, sizeof *last);
+  uchar *buf;
+
+  len[0] = len[1] = 0;
+  if (!status || !last) {
+    free (status);
+    free (last);
+    return 0;
+  }
+#ifdef LIBRAW_USE_OPENMP
+  if (omp_get_max_threads() > 1)
+#pragma omp parallel default(shared)
+  {
+    uchar *tbuf = (uchar *) malloc (maxrow);
+    int trow;
+#pragma omp for schedule(static,16)
+    for (trow=0; trow < raw_height; trow++)
+      if (tbuf)
+	status[trow] = phase_one_load_row_c (tbuf, maxrow,
+		data_offset + offset[trow], trow, last[trow]);
+    free (tbuf);
+  }
+#endif
+  buf = (uchar *) malloc (maxrow);
+  for (row=0; buf && row < raw_height; row++) {
+    if (status[row] == 1)
+      for (i=0; i < 2; i++) {
+	if (last[row][i]) len[i] = last[row][i];
+      }
+    else {
+      seed[0] = len[0];
+      seed[1] = len[1];
+      if (phase_one_load_row_c (buf, maxrow,
+		data_offset + offset[row], row, seed) != 1)
+	break;
+      len[0] = seed[0];
+      len[1] = seed[1];
+    }
+  }
+  if (row < raw_height)		/* the serial decoder starts on clean rows */
+    memset (&RBAYER(row,0), 0, (size_t) (raw_height - row) * raw_width * sizeof *raw_image);
+  free (buf);
+  free (last);
+  free (status);
+  return row;
+}
+#endif
+
 void CLASS phase_one_load_raw_c()
 {
   static const int length[] = { 8,7,6,9,11,10,5,12,14,13 };
@@ -1827,7 +2496,12 @@ void CLASS phase_one_load_raw_c()
 #ifdef LIBRAW_LIBRARY_BUILD
   color_flags.curve_state = LIBRAW_COLORSTATE_CALCULATED;
 #endif
-  for (row=0; row < raw_height; row++) {
+#ifdef LIBRAW_LIBRARY_BUILD
+  row = phase_one_load_rows_c (offset, len);
+#else
+  row = 0;
+#endif
+  for (; row < raw_height; row++) {
     fseek (ifp, data_offset + offset[row], SEEK_SET);
     ph1_bits(-1);
     pred[0] = pred[1] = 0;
@@ -1952,7 +2626,7 @@ void CLASS leaf_hdr_load_raw()
   }
 }
 
-#line 2261 "dcraw/dcraw.c"
+#line 2935 "dcraw/dcraw.c"
 void CLASS sinar_4shot_load_raw()
 {
   ushort *pixel;
@@ -2018,6 +2692,99 @@ void CLASS imacon_full_load_raw()
 #endif
 }
 
+#ifdef LIBRAW_LIBRARY_BUILD
+/*
+   Unpack one row of tiff_bps-bit values, stored most significant bit
+   first, with one 64-bit big-endian load per value.  At least 8 bytes
+   must be readable past the row.  Returns the sum of the masked
+   pixels that packed_load_raw() adds to black.
+ */
+unsigned CLASS packed_load_row (uchar *data, int row, int pwide, int *zero)
+{
+  uchar *dp;
+  UINT64 w;
+  unsigned sum=0;
+  int bit, col, val, i;
+
+  for (bit=col=0; col < pwide; col++, bit += tiff_bps) {
+    dp = data + (bit >> 3);
+    w = (UINT64) ((unsigned) dp[0] << 24 | dp[1] << 16 | dp[2] << 8 | dp[3]) << 32
+      | ((unsigned) dp[4] << 24 | dp[5] << 16 | dp[6] << 8 | dp[7]);
+    val = w << (bit & 7) >> (64-tiff_bps);
+    i = (col ^ (load_flags >> 6)) - left_margin;
+    RBAYER(row+top_margin,i+left_margin) = val;
+    if (((unsigned)i>=width) && (load_flags & 32) ) {
+      sum += val;
+      *zero += !val;
+    }
+  }
+  return sum;
+}
+
+/*
+   Without interlacing or padding every row is bwide bytes of whole
+   bites, so rows are read a batch at a time, bites byte-swapped into
+   a plain bit stream and the rows unpacked in parallel.  Returns the
+   number of rows done, the rest is left to the bit loop.
+ */
+int CLASS packed_load_rows (int bwide, int pwide, int bite, int *zero)
+{
+  uchar *data, *dp, c;
+  int nrows=16, irow, n, r, i, bzero=0;
+  unsigned bsum=0;
+  size_t got;
+
+#ifdef LIBRAW_USE_OPENMP
+  nrows *= omp_get_max_threads();
+#endif
+  data = (uchar *) calloc ((size_t) nrows * bwide + 8, 1);
+  merror (data, "packed_load_rows()");
+  for (irow=0; irow < height; irow += n) {
+    n = MIN(nrows, height-irow);
+    got = fread (data, 1, (size_t) n * bwide, ifp);
+    if (got < (size_t) n * bwide) {
+      fseek (ifp, -(INT64) got, SEEK_CUR);
+      break;
+    }
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp parallel default(shared) private(dp,c,i)
+#endif
+    {
+      unsigned tsum=0;
+      int tzero=0, t;
+      if (bite > 8)
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp for schedule(static)
+#endif
+	for (t=0; t < n * bwide / (bite >> 3); t++) {
+	  dp = data + (size_t) t * (bite >> 3);
+	  for (i=0; i < (bite >> 4); i++) {
+	    c = dp[i];
+	    dp[i] = dp[(bite >> 3) - 1 - i];
+	    dp[(bite >> 3) - 1 - i] = c;
+	  }
+	}
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp for schedule(static)
+#endif
+      for (r=0; r < n; r++)
+	tsum += packed_load_row (data + (size_t) r * bwide, irow + r, pwide, &tzero);
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp critical
+#endif
+      {
+	bsum += tsum;
+	bzero += tzero;
+      }
+    }
+  }
+  free (data);
+  black += bsum;
+  *zero += bzero;
+  return irow;
+}
+#endif
+
 void CLASS packed_load_raw()
 {
   int vbits=0, bwide, pwide, rbits, bite, half, irow, row, col, val, i;
@@ -2030,9 +2797,21 @@ void CLASS packed_load_raw()
   rbits = bwide * 8 - pwide * tiff_bps;
   if (load_flags & 1) bwide = bwide * 16 / 15;
   fseek (ifp, top_margin*bwide, SEEK_CUR);
+#ifdef LIBRAW_LIBRARY_BUILD
+  getbyte_buf(1);
+#endif
   bite = 8 + (load_flags & 24);
   half = (height+1) >> 1;
-  for (irow=0; irow < height; irow++) 
+  irow = 0;
+#ifdef LIBRAW_LIBRARY_BUILD
+  if (!(load_flags & 3) && rbits >= 0 && bwide * 8 % bite == 0 && tiff_bps > 0 && tiff_bps <= 16
+      && ((pwide-1) | load_flags >> 6) < raw_width)
+    {
+      irow = packed_load_rows (bwide, pwide, bite, &zero);
+      getbyte_buf(1);
+    }
+#endif
+  for (; irow < height; irow++) 
   {
     row = irow;
     if (load_flags & 2 &&
@@ -2044,12 +2823,15 @@ void CLASS packed_load_raw()
 	fseek (ifp, 0, SEEK_END);
 	fseek (ifp, ftell(ifp) >> 3 << 2, SEEK_SET);
       }
+#ifdef LIBRAW_LIBRARY_BUILD
+      getbyte_buf(1);
+#endif
     }
     for (col=0; col < pwide; col++) {
       for (vbits -= tiff_bps; vbits < 0; vbits += bite) {
 	bitbuf <<= bite;
 	for (i=0; i < bite; i+=8)
-	  bitbuf |= (unsigned) (fgetc(ifp) << i);
+	  bitbuf |= (unsigned) (getbyte() << i);
       }
       val = bitbuf << (64-tiff_bps-vbits) >> (64-tiff_bps);
       i = (col ^ (load_flags >> 6)) - left_margin;
@@ -2068,7 +2850,7 @@ void CLASS packed_load_raw()
       }
 #endif
       if (load_flags & 1 && (col % 10) == 9 &&
-	fgetc(ifp) && col < width+left_margin) derror();
+	getbyte() && col < width+left_margin) derror();
     }
     vbits -= rbits;
   }
@@ -2096,21 +2878,54 @@ void CLASS unpacked_load_raw()
   }
   free (pixel);
 #else
-  // fseek (ifp, (top_margin*raw_width + left_margin) * 2, SEEK_CUR);
-  pixel = (ushort *) calloc (raw_width, sizeof *pixel);
-  merror (pixel, "unpacked_load_raw()");
-  for (row=0; row < raw_height; row++) {
-    read_shorts (pixel, raw_width);
-    for (col=0; col < raw_width; col++)
-        {
-            RBAYER(row,col) = pixel[col]>>load_flags;
-            if( ((unsigned)(row-top_margin) < height)
-                && ((unsigned)(col-left_margin)<width ))
-                if(RBAYER(row,col)>>bits)
-                    derror();
-        }
+  /*
+     The whole image is read straight into raw_image, then byte-swapped,
+     shifted and range-checked in one pass per row.  Errors are raised
+     for the first bad row, with the file positioned past it as if rows
+     had been read one at a time.  The rows are contiguous, so one
+     sequential read beats per-row read_at() calls, which would have to
+     be serialized for file streams anyway; only the fix-up pass is
+     parallel.
+   */
+  INT64 start = ftell(ifp);
+  size_t got;
+  int rows, bad, swap, lcol, rcol;
+
+  got = fread (raw_image, 2, (size_t) raw_height * raw_width, ifp);
+  rows = raw_width ? got / raw_width : 0;
+  bad = rows;
+  swap = (order == 0x4949) == (ntohs(0x1234) == 0x1234);
+  lcol = MIN(left_margin, raw_width);
+  rcol = MIN(left_margin + width, raw_width);
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp parallel for default(shared) private(col,pixel) schedule(static)
+#endif
+  for (row=0; row < rows; row++) {
+    unsigned over=0;
+    pixel = &RBAYER(row,0);
+    if (swap)
+      for (col=0; col < raw_width; col++)
+	pixel[col] = (ushort) (pixel[col] << 8 | pixel[col] >> 8) >> load_flags;
+    else if (load_flags)
+      for (col=0; col < raw_width; col++)
+	pixel[col] >>= load_flags;
+    if ((unsigned)(row-top_margin) < height) {
+      for (col=lcol; col < rcol; col++)
+	over |= pixel[col];
+      if (over >> bits) {
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp critical
+#endif
+	if (row < bad) bad = row;
+      }
+    }
   }
-  free (pixel);
+  if (bad < rows) {
+    fseek (ifp, start + (INT64) (bad+1) * raw_width * 2, SEEK_SET);
+    derror();
+    fseek (ifp, start + (INT64) got * 2, SEEK_SET);
+  }
+  if (rows < raw_height) derror();
 #endif
 }
 
@@ -2169,10 +2984,96 @@ unsigned CLASS pana_bits (int nbits)
 #endif
 }
 
+#if defined(LIBRAW_LIBRARY_BUILD) && defined(LIBRAW_USE_OPENMP)
+/*
+   Decode the 14-pixel groups of one 0x4000-byte block, rotated by
+   load_flags like pana_bits() does.  A group normally takes exactly
+   128 bits, which is what puts group n of block b at pixel 14*(1024*b+n);
+   returns 0 if one does not, or if a pixel is out of range.
+ */
+int CLASS panasonic_load_block (uchar *blk, unsigned group, unsigned ngroups)
+{
+  uchar buf[0x4001];
+  int vbits=0, byte, i, j, sh=0, pred[2], nonz[2];
+  unsigned g, row, col;
+
+  memcpy (buf+load_flags, blk, 0x4000-load_flags);
+  memcpy (buf, blk+0x4000-load_flags, load_flags);
+  buf[0x4000] = 0;
+#define pbits(n) (vbits = (vbits - (n)) & 0x1ffff, byte = vbits >> 3 ^ 0x3ff0, \
+	(buf[byte] | buf[byte+1] << 8) >> (vbits & 7) & ~(-1 << (n)))
+  for (g=0; g < ngroups; g++) {
+    row = (group + g) * 14 / raw_width;
+    col = (group + g) * 14 % raw_width;
+    pred[0] = pred[1] = nonz[0] = nonz[1] = 0;
+    for (i=0; i < 14; i++, col++) {
+      if (i % 3 == 2) sh = 4 >> (3 - pbits(2));
+      if (nonz[i & 1]) {
+	if ((j = pbits(8))) {
+	  if ((pred[i & 1] -= 0x80 << sh) < 0 || sh == 4)
+	       pred[i & 1] &= ~(-1 << sh);
+	  pred[i & 1] += j << sh;
+	}
+      } else if ((nonz[i & 1] = pbits(8)) || i > 11)
+	pred[i & 1] = nonz[i & 1] << 4 | pbits(4);
+      RBAYER(row,col) = pred[i & 1];
+      if (col < width && RBAYER(row,col) > 4098) return 0;
+    }
+    if (vbits != (-128 * (int)(g+1) & 0x1ffff)) return 0;
+  }
+#undef pbits
+  return 1;
+}
+
+/*
+   Decode all blocks in parallel.  Returns 0, with the file position
+   restored, when the serial decoder has to run instead.
+ */
+int CLASS panasonic_load_blocks()
+{
+  unsigned ngroups, nblocks, last, need;
+  INT64 save = ftell(ifp);
+  size_t got;
+  uchar *data;
+  int b, failed = 0;
+
+  if (raw_width % 14 || load_flags >= 0x4000 || omp_get_max_threads() < 2)
+    return 0;
+  if (!(ngroups = height * raw_width / 14)) return 0;
+  nblocks = (ngroups + 1023) >> 10;
+  if (!(data = (uchar *) calloc (nblocks, 0x4000))) return 0;
+  got = fread (data, 1, (size_t) nblocks << 14, ifp);
+  // a short last block keeps stale bytes in pana_bits(),
+  // so the groups decoded must not reach past the data read
+  last = ((ngroups - 1) & 1023) + 1;
+  if (last*16 <= load_flags)
+    need = 0x4000 - load_flags + last*16;
+  else
+    need = load_flags ? 0x4000 : last*16;
+  if (got < ((size_t) (nblocks-1) << 14) + need)
+    failed = 1;
+  else
+#pragma omp parallel for default(shared) schedule(dynamic)
+    for (b=0; b < (int) nblocks; b++)
+      if (!failed && !panasonic_load_block (data + ((size_t) b << 14), b << 10,
+					    MIN(1024, ngroups - (b << 10))))
+	{
+#pragma omp critical
+	  failed = 1;
+	}
+  free (data);
+  if (failed) fseek (ifp, save, SEEK_SET);
+  return !failed;
+}
+#endif
+
 void CLASS panasonic_load_raw()
 {
   int row, col, i, j, sh=0, pred[2], nonz[2];
 
+#if defined(LIBRAW_LIBRARY_BUILD) && defined(LIBRAW_USE_OPENMP)
+  if (panasonic_load_blocks()) return;
+#endif
   pana_bits(0);
   for (row=0; row < height; row++)
     for (col=0; col < raw_width; col++) {
@@ -2860,7 +3761,14 @@ void CLASS kodak_thumb_load_raw()
   maximum = (1 << (thumb_misc & 31)) - 1;
 }
 
-void CLASS sony_decrypt (unsigned *data, int len, int start, int key)
+#ifdef LIBRAW_LIBRARY_BUILD
+/*
+   Pad words follow s[n] = s[n-127] ^ s[n-63], so once the last 127
+   words are laid out in order, the next ones are produced 63 at a time
+   by a plain loop.  Fills ks[0..126] from the pad, appends the next len
+   words after them and advances the pad past them.
+ */
+void CLASS sony_keystream (unsigned *ks, int len, int start, int key)
 {
 #ifndef LIBRAW_NOTHREADS
 #define pad tls->sony_decrypt.pad
@@ -2868,6 +3776,7 @@ void CLASS sony_decrypt (unsigned *data, int len, int start, int key)
 #else
   static unsigned pad[128], p;
 #endif
+  int i;
 
   if (start) {
     for (p=0; p < 4; p++)
@@ -2878,14 +3787,117 @@ void CLASS sony_decrypt (unsigned *data, int len, int start, int key)
     for (p=0; p < 127; p++)
       pad[p] = htonl(pad[p]);
   }
-  while (len--)
-    *data++ ^= pad[p++ & 127] = pad[(p+1) & 127] ^ pad[(p+65) & 127];
+  for (i=0; i < 127; i++)
+    ks[i] = pad[(p+1+i) & 127];
+  for (i=0; i < len; i++)
+    ks[127+i] = ks[i] ^ ks[i+64];
+  for (p += len, i=0; i < 127; i++)
+    pad[(p+1+i) & 127] = ks[len+i];
 #ifndef LIBRAW_NOTHREADS
 #undef pad
 #undef p
 #endif
 }
 
+void CLASS sony_decrypt (unsigned *data, int len, int start, int key)
+{
+  unsigned ks[127+1024];
+  int i, n;
+
+  do {
+    sony_keystream (ks, n = MIN(len, 1024), start, key);
+    for (i=0; i < n; i++)
+      data[i] ^= ks[127+i];
+    data += n;
+    start = 0;
+  } while ((len -= n) > 0);
+}
+#else
+void CLASS sony_decrypt (unsigned *data, int len, int start, int key)
+{
+  static unsigned pad[128], p;
+
+  if (start) {
+    for (p=0; p < 4; p++)
+      pad[p] = key = key * 48828125 + 1;
+    pad[3] = pad[3] << 1 | (pad[0]^pad[2]) >> 31;
+    for (p=4; p < 127; p++)
+      pad[p] = (pad[p-4]^pad[p-2]) << 1 | (pad[p-3]^pad[p-1]) >> 31;
+    for (p=0; p < 127; p++)
+      pad[p] = htonl(pad[p]);
+  }
+  while (len--)
+    *data++ ^= pad[p++ & 127] = pad[(p+1) & 127] ^ pad[(p+65) & 127];
+}
+#endif
+
+#ifdef LIBRAW_LIBRARY_BUILD
+/*
+   Rows are read a batch at a time.  Row r of the batch is decrypted
+   with the pad words from r*(raw_width/2) on, so once the pad of the
+   whole batch is generated, rows are decrypted and stored in parallel.
+ */
+void CLASS sony_load_rows (unsigned key)
+{
+  int nrows=16, rwords = raw_width/2, row, want, n, r, bad;
+  size_t got;
+  ushort *data;
+  unsigned *ks, bsum=0;
+
+#ifdef LIBRAW_USE_OPENMP
+  nrows *= omp_get_max_threads();
+#endif
+  data = (ushort *) malloc ((size_t) nrows * raw_width * sizeof *data);
+  merror (data, "sony_load_rows()");
+  ks = (unsigned *) malloc ((127 + (size_t) nrows * rwords) * sizeof *ks);
+  merror (ks, "sony_load_rows()");
+  for (row=0; row < height; row += n) {
+    want = MIN(nrows, height-row);
+    got = fread (data, 2, (size_t) want * raw_width, ifp) / raw_width;
+    sony_keystream (ks, want * rwords, !row, key);
+    bad = n = MIN (want, (int) got);
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp parallel for schedule(static) default(shared) reduction(+:bsum)
+#endif
+    for (r=0; r < n; r++) {
+      ushort *pixel = data + (size_t) r * raw_width, *dp = &RBAYER(row+r,0);
+      unsigned *kp = ks + 127 + (size_t) r * rwords, w, over=0;
+      int i, col;
+      for (i=0; i < rwords; i++) {
+        memcpy (&w, pixel + 2*i, sizeof w);
+        w ^= kp[i];
+        memcpy (pixel + 2*i, &w, sizeof w);
+      }
+      for (col=0; col < raw_width; col++)
+        dp[col] = ntohs(pixel[col]);
+      for (col=9; col < left_margin && col < raw_width; col++)
+        bsum += dp[col];
+      for (col=left_margin; col < width+left_margin && col < raw_width; col++)
+        over |= dp[col];
+      if (over >> 14) {
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp critical
+#endif
+        if (r < bad) bad = r;
+      }
+    }
+    if (bad < n || n < want) {
+      // the old loop read and checked row by row, report where it stopped
+      if (bad < n)
+        fseek (ifp, data_offset + (INT64) (row + bad + 1) * raw_width * 2, SEEK_SET);
+      break;
+    }
+  }
+  free (ks);
+  free (data);
+  if (row < height) derror();
+  black += bsum;
+  if (left_margin > 9)
+    black /= (left_margin-9) * height;
+  maximum = 0x3ff0;
+}
+#endif
+
 void CLASS sony_load_raw()
 {
   uchar head[40];
@@ -2902,6 +3914,12 @@ void CLASS sony_load_raw()
   for (i=26; i-- > 22; )
     key = key << 8 | head[i];
   fseek (ifp, data_offset, SEEK_SET);
+#ifdef LIBRAW_LIBRARY_BUILD
+  if (raw_width > 1) {
+    sony_load_rows (key);
+    return;
+  }
+#endif
   pixel = (ushort *) calloc (raw_width, sizeof *pixel);
   merror (pixel, "sony_load_raw()");
   for (row=0; row < height; row++) {
@@ -2948,10 +3966,16 @@ void CLASS sony_arw_load_raw()
       
   LibRaw_bit_buffer bits;
   bits.reset();
+  /*
+     Samples come column by column, so they are collected in a buffer
+     of 32-column tiles and copied into raw_image a tile at a time.
+   */
+  ushort (*tile)[32] = (ushort (*)[32]) calloc (raw_height, sizeof *tile);
+  merror (tile, "sony_arw_load_raw()");
 #else
   getbits(-1);
 #endif
-  for (col = raw_width; col--; )
+  for (col = raw_width; col--; ) {
     for (row=0; row < raw_height+1; row+=2) {
       if (row == raw_height) row = 1;
 #ifdef LIBRAW_LIBRARY_BUILD
@@ -2978,42 +4002,95 @@ void CLASS sony_arw_load_raw()
               BAYER(row,col) = sum;
           }
 #else
-      RBAYER(row,col) = sum;
+      tile[row][col & 31] = sum;
 #endif
     }
 #ifdef LIBRAW_LIBRARY_BUILD
+    if (!(col & 31))
+      for (row=0; row < raw_height; row++)
+        memcpy (&RBAYER(row,col), tile[row], MIN(32, raw_width-col) * sizeof **tile);
+#endif
+  }
+#ifdef LIBRAW_LIBRARY_BUILD
+  free (tile);
   if(buf) delete buf;
 #endif
 }
 
-void CLASS sony_arw2_load_raw()
+/*
+   Decode the 16-pixel blocks of one row.  The 7-bit deltas sit at fixed
+   bit offsets, so they are all extracted first (in little-endian files
+   by shifting the block as two 64-bit words) and then handed out to the
+   pixels other than imax and imin.  With imax == imin a fifteenth delta
+   is used, which reaches into the next block.
+ */
+void CLASS sony_arw2_load_row (uchar *data, int row)
 {
-  uchar *data, *dp;
+  uchar *dp, *bp, tail[18];
   ushort pix[16];
-  int row, col, val, max, min, imax, imin, sh, bit, i;
+  int col, val, max, min, imax, imin, sh, bit, i, k, d[15];
+  UINT64 lo, hi;
+
+  for (dp=data, col=0; col < width-30; dp+=16) {
+    bp = dp;
+    if (dp + 18 > data + raw_width) {		// do not read past the row
+      memset (tail, 0, sizeof tail);
+      if (dp < data + raw_width)
+	memcpy (tail, dp, MIN(18, data + raw_width - dp));
+      bp = tail;
+    }
+    max = 0x7ff & (val = sget4(bp));
+    min = 0x7ff & val >> 11;
+    imax = 0x0f & val >> 22;
+    imin = 0x0f & val >> 26;
+    for (sh=0; sh < 4 && 0x80 << sh <= max-min; sh++);
+    if (order == 0x4949) {
+      lo = (unsigned) val | (UINT64) sget4(bp+4) << 32;
+      hi = sget4(bp+8) | (UINT64) sget4(bp+12) << 32;
+      for (bit=30, k=0; k < 14; k++, bit+=7)
+	d[k] = (bit < 64 ? lo >> bit | hi << 1 << (63-bit) : hi >> (bit-64)) & 0x7f;
+      d[14] = bp[16] & 0x7f;
+    } else
+      for (bit=30, k=0; k < 15; k++, bit+=7)
+	d[k] = sget2(bp+(bit >> 3)) >> (bit & 7) & 0x7f;
+    for (i=0; i < 16; i++) {
+      if (i == imax || i == imin) continue;	// set below, k may be 15
+      k = i - (i > imax) - (i > imin && imin != imax);
+      pix[i] = MIN(0x7ff, (d[k] << sh) + min);
+    }
+    pix[imin] = min;
+    pix[imax] = max;
+    for (i=0; i < 16; i++, col+=2)
+      RBAYER(row,col) = curve[pix[i] << 1] >> 2;
+    col -= col & 1 ? 1:31;
+  }
+}
+
+void CLASS sony_arw2_load_raw()
+{
+  uchar *data;
+  int row, nrows=1, n, pn=1, r;
+  size_t got, i;
 
-  data = (uchar *) malloc (raw_width);
+#if defined(LIBRAW_LIBRARY_BUILD) && defined(LIBRAW_USE_OPENMP)
+  // rows are independent as long as none spills into the next one
+  if (omp_get_max_threads() > 1 && (width - 30 + 31) / 32 * 32 <= (int) raw_width)
+    nrows = 16 * omp_get_max_threads();
+#endif
+  data = (uchar *) calloc (nrows, raw_width);
   merror (data, "sony_arw2_load_raw()");
-  for (row=0; row < height; row++) {
-    fread (data, 1, raw_width, ifp);
-    for (dp=data, col=0; col < width-30; dp+=16) {
-      max = 0x7ff & (val = sget4(dp));
-      min = 0x7ff & val >> 11;
-      imax = 0x0f & val >> 22;
-      imin = 0x0f & val >> 26;
-      for (sh=0; sh < 4 && 0x80 << sh <= max-min; sh++);
-      for (bit=30, i=0; i < 16; i++)
-	if      (i == imax) pix[i] = max;
-	else if (i == imin) pix[i] = min;
-	else {
-	  pix[i] = ((sget2(dp+(bit >> 3)) >> (bit & 7) & 0x7f) << sh) + min;
-	  if (pix[i] > 0x7ff) pix[i] = 0x7ff;
-	  bit += 7;
-	}
-      for (i=0; i < 16; i++, col+=2)
-	RBAYER(row,col) = curve[pix[i] << 1] >> 2;
-      col -= col & 1 ? 1:31;
-    }
+  for (row=0; row < height; row += n) {
+    n = MIN(nrows, height-row);
+    got = fread (data, 1, (size_t) n * raw_width, ifp);
+    // past the end of data keep what a row by row read leaves behind
+    for (i=got; i < (size_t) n * raw_width; i++)
+      data[i] = data[i < raw_width ? (pn-1)*raw_width + i : i - raw_width];
+    pn = n;
+#if defined(LIBRAW_LIBRARY_BUILD) && defined(LIBRAW_USE_OPENMP)
+#pragma omp parallel for default(shared) schedule(static) if (n > 1)
+#endif
+    for (r=0; r < n; r++)
+      sony_arw2_load_row (data + (size_t) r * raw_width, row + r);
   }
   free (data);
 }
@@ -3227,7 +4304,7 @@ void CLASS redcine_load_raw()
   jas_stream_close (in);
 #endif
 }
-#line 3701 "dcraw/dcraw.c"
+#line 4778 "dcraw/dcraw.c"
 
 
 void CLASS gamma_curve (double pwr, double ts, int mode, int imax)
@@ -3602,9 +4679,10 @@ void CLASS green_matching()
   double m1,m2,c1,c2;
   int o1_1,o1_2,o1_3,o1_4;
   int o2_1,o2_2,o2_3,o2_4;
-  ushort (*img)[4];
+  ushort *img, *pix;
   const int margin = 3;
   int oj = 2, oi = 2;
+  int step = 4, g1 = 1, g2 = 3;   /* pixel stride and green channels */
   float f;
   const float thr = 0.01f;
   if(half_size || shrink) return;
@@ -3612,32 +4690,42 @@ void CLASS green_matching()
   if(FC(oj, oi) != 3) oi++;
   if(FC(oj, oi) != 3) oj--;
 
-  img = (ushort (*)[4]) calloc (height*width, sizeof *image);
+#ifdef LIBRAW_LIBRARY_BUILD
+  if (cfa_plane) {
+    pix = cfa_plane;
+    step = 1;
+    g1 = g2 = 0;
+  } else
+#endif
+  pix = image[0];
+  img = (ushort *) malloc (height*width*step*sizeof *img);
   merror (img, "green_matching()");
-  memcpy(img,image,height*width*sizeof *image);
+  memcpy(img,pix,height*width*step*sizeof *img);
+#define GM_PIX(row,col,g) img[((row)*width+(col))*step+(g)]
 
   for(j=oj;j<height-margin;j+=2)
     for(i=oi;i<width-margin;i+=2){
-      o1_1=img[(j-1)*width+i-1][1];
-      o1_2=img[(j-1)*width+i+1][1];
-      o1_3=img[(j+1)*width+i-1][1];
-      o1_4=img[(j+1)*width+i+1][1];
-      o2_1=img[(j-2)*width+i][3];
-      o2_2=img[(j+2)*width+i][3];
-      o2_3=img[j*width+i-2][3];
-      o2_4=img[j*width+i+2][3];
+      o1_1=GM_PIX(j-1,i-1,g1);
+      o1_2=GM_PIX(j-1,i+1,g1);
+      o1_3=GM_PIX(j+1,i-1,g1);
+      o1_4=GM_PIX(j+1,i+1,g1);
+      o2_1=GM_PIX(j-2,i,g2);
+      o2_2=GM_PIX(j+2,i,g2);
+      o2_3=GM_PIX(j,i-2,g2);
+      o2_4=GM_PIX(j,i+2,g2);
 
       m1=(o1_1+o1_2+o1_3+o1_4)/4.0;
       m2=(o2_1+o2_2+o2_3+o2_4)/4.0;
 
       c1=(abs(o1_1-o1_2)+abs(o1_1-o1_3)+abs(o1_1-o1_4)+abs(o1_2-o1_3)+abs(o1_3-o1_4)+abs(o1_2-o1_4))/6.0;
       c2=(abs(o2_1-o2_2)+abs(o2_1-o2_3)+abs(o2_1-o2_4)+abs(o2_2-o2_3)+abs(o2_3-o2_4)+abs(o2_2-o2_4))/6.0;
-      if((img[j*width+i][3]<maximum*0.95)&&(c1<maximum*thr)&&(c2<maximum*thr))
+      if((GM_PIX(j,i,g2)<maximum*0.95)&&(c1<maximum*thr)&&(c2<maximum*thr))
       {
-        f = image[j*width+i][3]*m1/m2;
-        image[j*width+i][3]=f>0xffff?0xffff:f;
+        f = pix[(j*width+i)*step+g2]*m1/m2;
+        pix[(j*width+i)*step+g2]=f>0xffff?0xffff:f;
       }
     }
+#undef GM_PIX
   free(img);
 }
 
@@ -3669,7 +4757,11 @@ void CLASS scale_colors()
 	    FORC4 {
 	      if (filters) {
 		c = FC(y,x);
+#ifdef LIBRAW_LIBRARY_BUILD
+		val = cfa_plane ? cfa_plane[y*iwidth+x] : BAYER(y,x);
+#else
 		val = BAYER(y,x);
+#endif
 	      } else
 		val = image[y*width+x][c];
 	      if (val > maximum-25) goto skip_block;
@@ -3742,6 +4834,25 @@ skip_block: ;
 #endif
 
   size = iheight*iwidth;
+#ifdef LIBRAW_LIBRARY_BUILD
+  if (cfa_plane) {
+    /* one sample per pixel, 2x2 pattern (see raw2image_ex) */
+#if defined(LIBRAW_USE_OPENMP)
+#pragma omp parallel for private(val,col,c) default(shared)
+#endif
+    for (i=0; i < (int) iheight; i++) {
+      ushort *cp = cfa_plane + i*iwidth;
+      int rc[2] = { FC(i,0), FC(i,1) };
+      for (col=0; col < iwidth; col++) {
+	if (!(val = cp[col])) continue;
+	c = rc[col & 1];
+	val -= cblack[c];
+	val *= scale_mul[c];
+	cp[col] = CLIP(val);
+      }
+    }
+  } else
+#endif
 #if defined(LIBRAW_USE_OPENMP)
 #pragma omp parallel for private(val) default(shared)
 #endif
@@ -4595,7 +5706,7 @@ void CLASS parse_thumb_note (int base, unsigned toff, unsigned tlen)
   }
 }
 
-#line 5072 "dcraw/dcraw.c"
+#line 6183 "dcraw/dcraw.c"
 void CLASS parse_makernote (int base, int uptag)
 {
   static const uchar xlat[2][256] = {
@@ -5173,7 +6284,7 @@ void CLASS parse_kodak_ifd (int base)
   }
 }
 
-#line 5654 "dcraw/dcraw.c"
+#line 6765 "dcraw/dcraw.c"
 int CLASS parse_tiff_ifd (int base)
 {
   unsigned entries, tag, type, len, plen=16, save;
@@ -6457,7 +7568,7 @@ void CLASS parse_redcine()
     data_offset = get4();
   }
 }
-#line 6944 "dcraw/dcraw.c"
+#line 8055 "dcraw/dcraw.c"
 void CLASS adobe_coeff (const char *p_make, const char *p_model)
 {
   static const struct {
@@ -7160,7 +8271,7 @@ short CLASS guess_byte_order (int words)
   return sum[0] < sum[1] ? 0x4d4d : 0x4949;
 }
 
-#line 7650 "dcraw/dcraw.c"
+#line 8761 "dcraw/dcraw.c"
 
 float CLASS find_green (int bps, int bite, int off0, int off1)
 {
@@ -8790,7 +9901,7 @@ else if (!strcmp(model,"QV-2000UX")) {
   }
 }
 
-#line 9373 "dcraw/dcraw.c"
+#line 10484 "dcraw/dcraw.c"
 void CLASS convert_to_rgb()
 {
   int row, col, c, i, j, k;
@@ -8886,6 +9997,12 @@ void CLASS convert_to_rgb()
   memset(histogram,0,sizeof(int)*LIBRAW_HISTOGRAM_SIZE*4);
 #else
   memset (histogram, 0, sizeof histogram);
+#endif
+#ifdef LIBRAW_LIBRARY_BUILD
+  if ((output_layout == LIBRAW_LAYOUT_RGB16 || output_layout == LIBRAW_LAYOUT_PLANAR)
+	&& !document_mode && (colors == 3 || (colors == 4 && output_color)))
+    convert_to_layout (out_cam);
+  else
 #endif
   for (img=image[0], row=0; row < height; row++)
     for (col=0; col < width; col++, img+=4) {
@@ -8909,6 +10026,56 @@ void CLASS convert_to_rgb()
 #endif
 }
 
+#ifdef LIBRAW_LIBRARY_BUILD
+/* convert_to_rgb() output as three samples per pixel: packed RGB16
+   is written in place (pixel i never lands above its source), planar
+   goes to a new buffer */
+void CLASS convert_to_layout (float (*out_cam)[4])
+{
+  size_t i, pixels = (size_t) height*width;
+  ushort *img = image[0], *rgb = image[0], *plane[3], val[3];
+  float out[3];
+  int c, step;
+
+  if (output_layout == LIBRAW_LAYOUT_PLANAR) {
+    rgb = (ushort *) malloc (pixels*3*sizeof *rgb);
+    merror (rgb, "convert_to_rgb()");
+    FORC3 plane[c] = rgb + c*pixels;
+    step = 1;
+  } else {
+    FORC3 plane[c] = rgb + c;
+    step = 3;
+  }
+  for (i=0; i < pixels; i++, img+=4) {
+    if (raw_color)
+      FORC3 val[c] = img[c];
+    else {
+      out[0] = out[1] = out[2] = 0;
+      FORCC {
+	out[0] += out_cam[0][c] * img[c];
+	out[1] += out_cam[1][c] * img[c];
+	out[2] += out_cam[2][c] * img[c];
+      }
+      FORC3 val[c] = CLIP((int) out[c]);
+    }
+    FORC3 {
+      plane[c][i*step] = val[c];
+      histogram[c][val[c] >> 3]++;
+    }
+  }
+  if (rgb != image[0]) {
+    if (imgdata.params.keep_buffers)
+      keep_spare (spare_image, image);
+    else
+      free (image);
+  } else if (!imgdata.params.keep_buffers)
+    rgb = (ushort *) realloc (image, pixels*3*sizeof *rgb);
+  merror (rgb, "convert_to_rgb()");
+  image = (ushort (*)[4]) rgb;
+  image_layout = output_layout;
+}
+#endif
+
 void CLASS fuji_rotate()
 {
   int i, row, col;
@@ -8968,6 +10135,13 @@ void CLASS stretch()
 #endif
 #ifdef DCRAW_VERBOSE
   if (verbose) fprintf (stderr,_("Stretching the image...\n"));
+#endif
+#ifdef LIBRAW_LIBRARY_BUILD
+  if (image_layout) {
+    stretch_layout();
+    RUN_CALLBACK(LIBRAW_PROGRESS_STRETCH,1,2);
+    return;
+  }
 #endif
   if (pixel_aspect < 1) {
     newdim = height / pixel_aspect + 0.5;
@@ -9001,6 +10175,52 @@ void CLASS stretch()
 #endif
 }
 
+#ifdef LIBRAW_LIBRARY_BUILD
+/* stretch() for RGB16 and planar images */
+void CLASS stretch_layout()
+{
+  ushort newdim, *img, *src = image[0];
+  int row, col, c, r0, r1, ps;
+  size_t ics, ocs, opix;
+  double rc, frac;
+
+  if (pixel_aspect < 1) {
+    newdim = height / pixel_aspect + 0.5;
+    opix = (size_t) width*newdim;
+  } else {
+    newdim = width * pixel_aspect + 0.5;
+    opix = (size_t) height*newdim;
+  }
+  image_steps ((size_t) height*width, &ps, &ics);
+  ocs = ps == 1 ? opix : 1;
+  img = (ushort *) calloc (opix*3, sizeof *img);
+  merror (img, "stretch()");
+  if (pixel_aspect < 1) {
+    for (rc=row=0; row < newdim; row++, rc+=pixel_aspect) {
+      frac = rc - (r0 = rc);
+      r1 = r0+1 < height ? r0+1 : r0;
+      for (col=0; col < width; col++)
+	FORC3 img[((size_t) row*width+col)*ps + c*ocs] =
+	  src[((size_t) r0*width+col)*ps + c*ics]*(1-frac) +
+	  src[((size_t) r1*width+col)*ps + c*ics]*frac + 0.5;
+    }
+    height = newdim;
+  } else {
+    for (rc=col=0; col < newdim; col++, rc+=1/pixel_aspect) {
+      frac = rc - (r0 = rc);
+      r1 = r0+1 < width ? r0+1 : r0;
+      for (row=0; row < height; row++)
+	FORC3 img[((size_t) row*newdim+col)*ps + c*ocs] =
+	  src[((size_t) row*width+r0)*ps + c*ics]*(1-frac) +
+	  src[((size_t) row*width+r1)*ps + c*ics]*frac + 0.5;
+    }
+    width = newdim;
+  }
+  free (image);
+  image = (ushort (*)[4]) img;
+}
+#endif
+
 int CLASS flip_index (int row, int col)
 {
   if (flip & 4) SWAP(row,col);
@@ -9009,7 +10229,7 @@ int CLASS flip_index (int row, int col)
   return row * iwidth + col;
 }
 
-#line 9616 "dcraw/dcraw.c"
+#line 10836 "dcraw/dcraw.c"
 void CLASS tiff_set (ushort *ntag,
 	ushort tag, ushort type, int count, int val)
 {
@@ -9170,15 +10390,25 @@ void CLASS write_ppm_tiff()
   soff  = flip_index (0, 0);
   cstep = flip_index (0, 1) - soff;
   rstep = flip_index (1, 0) - flip_index (0, width);
+#ifdef LIBRAW_LIBRARY_BUILD
+  ushort *img = image[0];
+  int ps;
+  size_t cs;
+  image_steps ((size_t) iheight*iwidth, &ps, &cs);
+#define PIXEL(c) img[soff*ps+(c)*cs]
+#else
+#define PIXEL(c) image[soff][c]
+#endif
   for (row=0; row < height; row++, soff += rstep) {
     for (col=0; col < width; col++, soff += cstep)
       if (output_bps == 8)
-	   FORCC ppm [col*colors+c] = curve[image[soff][c]] >> 8;
-      else FORCC ppm2[col*colors+c] = curve[image[soff][c]];
+	   FORCC ppm [col*colors+c] = curve[PIXEL(c)] >> 8;
+      else FORCC ppm2[col*colors+c] = curve[PIXEL(c)];
     if (output_bps == 16 && !output_tiff && htons(0x55aa) != 0x55aa)
         swab ((char*)ppm2, (char*)ppm2, width*colors*2);
     fwrite (ppm, colors*output_bps/8, width, ofp);
   }
+#undef PIXEL
   free (ppm);
 }
 
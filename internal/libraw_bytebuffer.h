@@ -17,72 +17,78 @@ it under the terms of the one of three licenses as you choose:
    (See file LICENSE.LibRaw.pdf provided in LibRaw distribution archive for details).
 
  */
+#define LIBRAW_LJPEG_WINDOW 16384
+
+// make_decoder_ref() reserves a direct diff table of 1<<LIBRAW_HUFF_FASTBITS
+// entries after the code table, filled by make_fast_decoder()
+#define LIBRAW_HUFF_FASTBITS 12
+#define LIBRAW_HUFF_FAST(huff) ((unsigned*)((huff) + ((2 + (1 << (huff)[0])) & ~1)))
+
+class LibRaw_bit_buffer;
+
 class LibRaw_byte_buffer
 {
   public:
     LibRaw_byte_buffer(unsigned sz=0);
     void set_buffer(void *bb, unsigned int sz);
+    void set_buffer(LibRaw_byte_buffer *src, unsigned int from);
     virtual ~LibRaw_byte_buffer();
     // fast inlines
     int get_byte() { if(offt>=size) return EOF; return buf[offt++];}
-    void unseek2() { if(offt>=2) offt-=2;}
     void *get_buffer() { return buf; }
-    int get_ljpeg_byte() {
-        if(offt>=size) return 0;
-        unsigned char val = buf[offt++];
-        if(val!=0xFF || offt >=size || buf[offt++]==0)
-            return val;
-        offt -=2;
-        return 0;
-    }
+    // lossless JPEG entropy data: destuffed window, refilled by ljpeg_fill()
+    void ljpeg_fill();
+    void ljpeg_restart();
+    void ljpeg_restarts(unsigned *pos, int count);
 
   private:
     unsigned char *buf;
     unsigned int  size,offt, do_free;
+    // destuffed bytes (0xFF00 -> 0xFF) up to the next marker
+    unsigned char *lj;
+    unsigned int  lj_pos,lj_len,lj_fill,lj_stop;
+    friend class LibRaw_bit_buffer;
 };
 
 class LibRaw_bit_buffer
 {
-    unsigned bitbuf;
+    UINT64 bitbuf;
     int vbits, rst;
+    LibRaw_byte_buffer *src;
   public:
-    LibRaw_bit_buffer() : bitbuf(0),vbits(0),rst(0) {}
+    LibRaw_bit_buffer() : bitbuf(0),vbits(0),rst(0),src(0) {}
 
-        void reset() {  bitbuf=vbits=rst=0;}
+        // whole bytes fetched ahead by the word refill are returned to the stream
+        void reset() {  if(src && vbits > 0) src->offt -= vbits >> 3; bitbuf=vbits=rst=0; src=0;}
 #ifndef LIBRAW_LIBRARY_BUILD
         void fill_lj(LibRaw_byte_buffer* buf,int nbits);
         unsigned _getbits_lj(LibRaw_byte_buffer* buf, int nbits);
         unsigned _gethuff_lj(LibRaw_byte_buffer* buf, int nbits, unsigned short* huff);
+        unsigned _getfast_lj(LibRaw_byte_buffer* buf, const unsigned *fast);
         void fill(LibRaw_byte_buffer* buf,int nbits,int zer0_ff);
         unsigned _getbits(LibRaw_byte_buffer* buf, int nbits,int zer0_ff);
         unsigned _gethuff(LibRaw_byte_buffer* buf, int nbits, unsigned short* huff, int zer0_ff);
+        unsigned _getfast(LibRaw_byte_buffer* buf, const unsigned *fast, int zer0_ff);
 #else
+        static UINT64 get_be64(const unsigned char *p)
+        {
+            return ((UINT64)p[0] << 56) | ((UINT64)p[1] << 48) | ((UINT64)p[2] << 40) | ((UINT64)p[3] << 32)
+                | ((UINT64)p[4] << 24) | ((UINT64)p[5] << 16) | ((UINT64)p[6] << 8) | (UINT64)p[7];
+        }
+        void fill_word(const unsigned char *p)
+        {
+            int k = (63 - vbits) & ~7;
+            bitbuf = (bitbuf << k) | (get_be64(p) >> (64 - k));
+            vbits += k;
+        }
         void fill_lj(LibRaw_byte_buffer* buf,int nbits)
         {
-            unsigned c1,c2,c3;
-            if(rst || nbits < vbits) return;
-            int m = vbits >> 3;
-            switch(m)
-                {
-                case 2:	
-                    c1 = buf->get_ljpeg_byte();
-                    bitbuf = (bitbuf <<8) | (c1);
-                    vbits+=8;
-                    break;
-                case 1:
-                    c1 = buf->get_ljpeg_byte();
-                    c2 = buf->get_ljpeg_byte();
-                    bitbuf = (bitbuf <<16) | (c1<<8) | c2;
-                    vbits+=16;		
-                    break;
-                case 0:
-                    c1 = buf->get_ljpeg_byte();
-                    c2 = buf->get_ljpeg_byte();
-                    c3 = buf->get_ljpeg_byte();
-                    bitbuf = (bitbuf <<24) | (c1<<16) | (c2<<8)|c3;
-                    vbits+=24;
-                    break;
-                }
+            if(nbits <= vbits) return;
+            if(buf->lj_pos + 8 > buf->lj_fill)
+                buf->ljpeg_fill();
+            int v = vbits;
+            fill_word(buf->lj + buf->lj_pos);
+            buf->lj_pos += (vbits - v) >> 3;
         }
 
         unsigned _getbits_lj(LibRaw_byte_buffer* buf, int nbits)
@@ -90,7 +96,7 @@ class LibRaw_bit_buffer
             unsigned c;
             if(nbits==0 || vbits < 0) return 0;
             fill_lj(buf,nbits);
-            c = bitbuf << (32-vbits) >> (32-nbits);
+            c = bitbuf << (64-vbits) >> (64-nbits);
             vbits-=nbits;
             if(vbits<0)throw LIBRAW_EXCEPTION_IO_EOF;
             return c;
@@ -100,15 +106,35 @@ class LibRaw_bit_buffer
             unsigned c;
             if(nbits==0 || vbits < 0) return 0;
             fill_lj(buf,nbits);
-            c = bitbuf << (32-vbits) >> (32-nbits);
+            c = bitbuf << (64-vbits) >> (64-nbits);
             vbits -= huff[c] >> 8;
             c = (uchar) huff[c];
             if(vbits<0)throw LIBRAW_EXCEPTION_IO_EOF;
             return c;
         }
+        // code and difference bits in one lookup: returns the fast table entry
+        // (diff << 16 | bits used), 0 if the caller has to decode the slow way
+        unsigned _getfast_lj(LibRaw_byte_buffer* buf, const unsigned *fast)
+        {
+            unsigned e;
+            if(vbits < 0) return 0;
+            fill_lj(buf,LIBRAW_HUFF_FASTBITS);
+            e = fast[bitbuf << (64-vbits) >> (64-LIBRAW_HUFF_FASTBITS)];
+            vbits -= e & 0xff;
+            return e;
+        }
         void fill(LibRaw_byte_buffer* buf,int nbits,int zer0_ff)
         {
             unsigned c;
+            if(nbits <= vbits) return;
+            if(!zer0_ff && buf->offt + 8 <= buf->size)
+                {
+                    int v = vbits;
+                    fill_word(buf->buf + buf->offt);
+                    buf->offt += (vbits - v) >> 3;
+                    src = buf;
+                    return;
+                }
             while (!rst && vbits < nbits && (c = buf->get_byte()) != EOF &&
                    !(rst = zer0_ff && c == 0xff && buf->get_byte())) {
                 bitbuf = (bitbuf << 8) + (uchar) c;
@@ -120,7 +146,7 @@ class LibRaw_bit_buffer
             unsigned c;
             if(nbits==0 || vbits < 0) return 0;
             fill(buf,nbits,zer0_ff);
-            c = bitbuf << (32-vbits) >> (32-nbits);
+            c = bitbuf << (64-vbits) >> (64-nbits);
             vbits-=nbits;
             if(vbits<0)throw LIBRAW_EXCEPTION_IO_EOF;
             return c;
@@ -130,11 +156,21 @@ class LibRaw_bit_buffer
             unsigned c;
             if(nbits==0 || vbits < 0) return 0;
             fill(buf,nbits,zer0_ff);
-            c = bitbuf << (32-vbits) >> (32-nbits);
+            c = bitbuf << (64-vbits) >> (64-nbits);
             vbits -= huff[c] >> 8;
             c = (uchar) huff[c];
             if(vbits<0)throw LIBRAW_EXCEPTION_IO_EOF;
             return c;
         }
+        unsigned _getfast(LibRaw_byte_buffer* buf, const unsigned *fast, int zer0_ff)
+        {
+            unsigned e;
+            if(vbits < 0) return 0;
+            fill(buf,LIBRAW_HUFF_FASTBITS,zer0_ff);
+            if(vbits < LIBRAW_HUFF_FASTBITS) return 0;
+            e = fast[bitbuf << (64-vbits) >> (64-LIBRAW_HUFF_FASTBITS)];
+            vbits -= e & 0xff;
+            return e;
+        }
 #endif
 };
@@ -43,9 +43,11 @@ it under the terms of the one of three licenses as you choose:
     void        ciff_block_1030();
 
 // LJPEG decoder
+    int         getbyte_buf (int drop);
     unsigned    getbithuff (int nbits, ushort *huff);
     ushort*     make_decoder_ref (const uchar **source);
     ushort*     make_decoder (const uchar *source);
+    void        make_fast_decoder (ushort *huff, int nikon);
     int         ljpeg_start (struct jhead *jh, int info_only);
     void        ljpeg_end(struct jhead *jh);
     int         ljpeg_diff (ushort *huff); 
@@ -59,12 +61,23 @@ it under the terms of the one of three licenses as you choose:
 // Canon DSLRs
 void        crw_init_tables (unsigned table, ushort *huff[2]);
     int         canon_has_lowbits();
+    void        canon_load_lowbits();
     void        canon_compressed_load_raw();
     void        lossless_jpeg_load_raw();
+    int         ljpeg_intervals (struct jhead *jh, LibRaw_byte_buffer *buf, unsigned **pos);
+    void        lossless_jpeg_stats (const ushort *vp, unsigned first, unsigned last, int *min, unsigned *cb);
+    void        lossless_jpeg_rows (struct jhead *jh, LibRaw_byte_buffer *buf, int jrow, int jend,
+                                    unsigned *pix, const unsigned *offset, const unsigned *slicesW,
+                                    int *min, unsigned *cb);
     void        canon_sraw_load_raw();
 // Adobe DNG
     void        adobe_copy_pixel (int row, int col, ushort **rp);
     void        adobe_dng_load_raw_lj();
+    void        adobe_dng_lj_rows (struct jhead *jh, LibRaw_byte_buffer *buf, unsigned jrow, unsigned jend,
+                                   unsigned trow, unsigned tcol, unsigned jwide, unsigned row, unsigned col);
+    int         adobe_dng_lj_intervals (struct jhead *jh, LibRaw_byte_buffer *buf,
+                                        unsigned trow, unsigned tcol, unsigned jwide);
+    void        adobe_dng_lj_tiles();
     void        adobe_dng_load_raw_nc();
 
 // Pentax
@@ -99,11 +112,15 @@ void        crw_init_tables (unsigned table, ushort *huff[2]);
     void        phase_one_correct();
     void        phase_one_load_raw();
     unsigned    ph1_bits (int nbits);
+    int         phase_one_load_row_c (uchar *buf, unsigned size, INT64 offset, int row, int *len);
+    int         phase_one_load_rows_c (int *offset, int *len);
     void        phase_one_load_raw_c();
     void        hasselblad_load_raw();
     void        leaf_hdr_load_raw();
     void        sinar_4shot_load_raw();
     void        imacon_full_load_raw();
+    unsigned    packed_load_row (uchar *data, int row, int pwide, int *zero);
+    int         packed_load_rows (int bwide, int pwide, int bite, int *zero);
     void        packed_load_raw();
     float	find_green(int,int,int,int);
     void        unpacked_load_raw();
@@ -113,6 +130,8 @@ void        crw_init_tables (unsigned table, ushort *huff[2]);
 // Misc P&S cameras
     void        nokia_load_raw();
     unsigned    pana_bits (int nbits);
+    int         panasonic_load_block (uchar *blk, unsigned group, unsigned ngroups);
+    int         panasonic_load_blocks();
     void        panasonic_load_raw();
     void        olympus_load_raw();
     void        olympus_cseries_load_raw();
@@ -146,8 +165,11 @@ void        crw_init_tables (unsigned table, ushort *huff[2]);
 
 // It's a Sony (and K&M)
     void        sony_decrypt (unsigned *data, int len, int start, int key);
+    void        sony_keystream (unsigned *ks, int len, int start, int key);
+    void        sony_load_rows (unsigned key);
     void        sony_load_raw();
     void        sony_arw_load_raw();
+    void        sony_arw2_load_row (uchar *data, int row);
     void        sony_arw2_load_raw();
     void        parse_minolta (int base);
 
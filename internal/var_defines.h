@@ -33,6 +33,7 @@ it under the terms of the one of three licenses as you choose:
 
 //imgdata image
 #define image           (imgdata.image)
+#define image_layout    (imgdata.image_layout)
 #define raw_image       (imgdata.rawdata.raw_image)
 #define color_image       (imgdata.rawdata.color_image)
 
@@ -109,6 +110,7 @@ it under the terms of the one of three licenses as you choose:
 #define use_camera_matrix (imgdata.params.use_camera_matrix)
 #define output_color    (imgdata.params.output_color)
 #define output_bps      (imgdata.params.output_bps)
+#define output_layout   (imgdata.params.output_layout)
 #define gamma_16bit      (imgdata.params.gamma_16bit)
 #define output_tiff     (imgdata.params.output_tiff)
 #define med_passes      (imgdata.params.med_passes)
@@ -159,6 +161,7 @@ it under the terms of the one of three licenses as you choose:
 //libraw_internal_data.output_data
 #define histogram       (libraw_internal_data.output_data.histogram)
 #define oprof           (libraw_internal_data.output_data.oprof)
+#define cfa_plane       (libraw_internal_data.output_data.cfa_plane)
 
 //libraw_internal_data.identify_data
 #define exif_cfa        (libraw_internal_data.identify_data.olympus_exif_cfa)
@@ -54,6 +54,9 @@ DllDef    libraw_data_t       *libraw_init(unsigned int flags);
 DllDef    int                 libraw_open_file(libraw_data_t*, const char *);
 DllDef    int                 libraw_open_file_ex(libraw_data_t*, const char *, INT64 max_buff_sz);
 DllDef    int                 libraw_open_buffer(libraw_data_t*, void * buffer, size_t size);
+#ifndef WIN32
+DllDef    int                 libraw_open_fd(libraw_data_t*, int fd);
+#endif
 DllDef    int                 libraw_unpack(libraw_data_t*);
 DllDef    int                 libraw_unpack_thumb(libraw_data_t*);
 DllDef    void                libraw_recycle(libraw_data_t*);
@@ -73,6 +76,16 @@ DllDef    void                libraw_set_dataerror_handler(libraw_data_t*,data_c
 DllDef    void                libraw_set_progress_handler(libraw_data_t*,progress_callback cb,void *datap);
 DllDef    const char *        libraw_unpack_function_name(libraw_data_t* lr);
 DllDef    int                 libraw_get_decoder_info(libraw_data_t* lr,libraw_decoder_info_t* d);
+DllDef    int                 libraw_get_io_stats(libraw_data_t* lr,libraw_iostats_t* st);
+DllDef    int                 libraw_set_allocator(libraw_data_t* lr,const libraw_allocator_t* a);
+DllDef    int                 libraw_set_raw_buffer(libraw_data_t* lr,void *ptr,size_t bytes);
+DllDef    int                 libraw_set_image_buffer(libraw_data_t* lr,void *ptr,size_t bytes);
+    /* stock allocators */
+DllDef    const libraw_allocator_t* libraw_default_allocator();
+DllDef    void                libraw_aligned_allocator(libraw_allocator_t* a,size_t alignment);
+DllDef    libraw_arena_t*     libraw_arena_create(size_t chunk_size);
+DllDef    void                libraw_arena_destroy(libraw_arena_t* ar);
+DllDef    void                libraw_arena_allocator(libraw_allocator_t* a,libraw_arena_t* ar);
 
     /* DCRAW compatibility */
 DllDef    int                 libraw_adjust_sizes_info_only(libraw_data_t*);
@@ -101,6 +114,9 @@ class DllDef LibRaw
     libraw_output_params_t*     output_params_ptr() { return &imgdata.params;}
     int                         open_file(const char *fname, INT64 max_buffered_sz=LIBRAW_USE_STREAMS_DATASTREAM_MAXSIZE);
     int                         open_buffer(void *buffer, size_t size);
+#ifndef WIN32
+    int                         open_fd(int fd);
+#endif
     int                         open_datastream(LibRaw_abstract_datastream *);
     int                         unpack(void);
     int                         unpack_thumb(void);
@@ -148,6 +164,12 @@ class DllDef LibRaw
     
     const char *unpack_function_name();
     int get_decoder_info(libraw_decoder_info_t* d_info);
+    int get_io_stats(libraw_iostats_t* st);
+    /* call before open_file() or after recycle() */
+    int set_allocator(const libraw_allocator_t* a);
+    /* caller-owned memory for rawdata.raw_alloc and image, NULL to unset */
+    int set_raw_buffer(void *ptr, size_t bytes);
+    int set_image_buffer(void *ptr, size_t bytes);
 
   private:
 
@@ -175,6 +197,20 @@ class DllDef LibRaw
     decode      first_decode[2048], *second_decode, *free_decode;
     tiff_ifd_t  tiff_ifd[10];
     libraw_memmgr memmgr;
+    /* buffers kept by recycle()/free_image() when params.keep_buffers is set */
+    void        *spare_raw, *spare_image, *spare_hist;
+    void        keep_spare(void *&spare, void *buf);
+    void*       take_spare(void *&spare, size_t sz, int zero);
+    void        alloc_image(size_t pixels, int zero, const char *where);
+    void        image_steps(size_t pixels, int *pstep, size_t *cstep);
+    /* set_raw_buffer()/set_image_buffer() memory */
+    void        *user_raw, *user_image;
+    size_t      user_raw_size, user_image_size;
+    void*       alloc_raw(size_t sz, int zero);
+    /* compact Bayer plane for dcraw_process() */
+    int         raw2image_cfa(void);
+    void        cfa_to_image(void);
+    void        cfa_row_to_image(int row);
     libraw_callbacks_t callbacks;
 
     LibRaw_constants rgb_constants;
@@ -192,6 +228,7 @@ class DllDef LibRaw
     void        identify2(unsigned, unsigned, char*);
     void        write_ppm_tiff ();
     void        convert_to_rgb();
+    void        convert_to_layout(float (*out_cam)[4]);
     void        remove_zeroes();
 #ifndef NO_LCMS
     void	apply_profile(const char*,const char*);
@@ -232,6 +269,7 @@ class DllDef LibRaw
 
     void        fuji_rotate();
     void        stretch();
+    void        stretch_layout();
 
     void        foveon_thumb ();
     void        jpeg_thumb_writer (FILE *tfp,char *thumb,int thumb_length);
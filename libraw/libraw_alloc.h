@@ -24,74 +24,54 @@ it under the terms of the one of three licenses as you choose:
 
 #include <stdlib.h>
 #include <string.h>
+#include "libraw_types.h"
 
 #ifdef __cplusplus
 
-#define MSIZE 32
-
+/*
+   Tracks every block handed out through the allocator, so recycle() can
+   release whatever a decoder left behind.  Live blocks are kept in a
+   dense list (cleanup is O(live blocks)) indexed by an open addressing
+   hash on the pointer (free is O(1)).  Pointers that were not allocated
+   here are passed to ::free()/::realloc().
+ */
 class DllDef libraw_memmgr
 {
   public:
-    libraw_memmgr()
-        {
-            memset(mems,0,sizeof(mems));
-            calloc_cnt=0;
-        }
-    void *malloc(size_t sz)
-        {
-            void *ptr = ::malloc(sz);
-            mem_ptr(ptr);
-            return ptr;
-        }
-    void *calloc(size_t n, size_t sz)
-        {
-            void *ptr =  ::calloc(n,sz);
-            mem_ptr(ptr);
-            return ptr;
-        }
-    void *realloc(void *ptr,size_t newsz)
-        {
-            void *ret = ::realloc(ptr,newsz);
-            forget_ptr(ptr);
-            mem_ptr(ret);
-            return ret;
-        }
-    void  free(void *ptr)
-    {
-        forget_ptr(ptr);
-        ::free(ptr);
-    }
-    void cleanup(void)
-    {
-        for(int i = 0; i< MSIZE; i++)
-            if(mems[i])
-                {
-                    free(mems[i]);
-                    mems[i] = NULL;
-                }
-    }
+    libraw_memmgr();
+    ~libraw_memmgr();
+    void *malloc(size_t sz);
+    void *calloc(size_t n, size_t sz);
+    void *realloc(void *ptr,size_t newsz);
+    void  free(void *ptr);
+    /* frees all blocks except the nkeep pointers in keep[] */
+    void  cleanup(void *const *keep = NULL, int nkeep = 0);
+    /* NULL restores the default, LIBRAW_OUT_OF_ORDER_CALL while blocks are live */
+    int   set_allocator(const libraw_allocator_t *a);
+    const libraw_allocator_t& allocator() const { return alloc; }
+    unsigned live_blocks() const { return nblocks; }
+    /* 0 for pointers not allocated here */
+    size_t block_size(void *ptr);
+    /*
+       Tracks caller-owned memory like an allocated block: free() only
+       forgets it, realloc() keeps it while the new size fits.  Returns 0
+       if ptr is already tracked.
+     */
+    int   add_external(void *ptr, size_t sz);
 
   private:
-    void *mems[MSIZE];
-    int calloc_cnt;
-    void mem_ptr(void *ptr)
-    {
-        if(ptr)
-            for(int i=0;i < MSIZE; i++)
-                if(!mems[i])
-                    {
-                        mems[i] = ptr;
-                        break;
-                    }
-    }
-    void forget_ptr(void *ptr)
-    {
-        if(ptr)
-            for(int i=0;i < MSIZE; i++)
-                if(mems[i] == ptr)
-                    mems[i] = NULL;
-    }
+    struct block { void *ptr; size_t size; int external; };
+    libraw_allocator_t alloc;
+    block       *blocks;
+    unsigned    nblocks, maxblocks;
+    unsigned    *index, indexmask;  /* blocks[] position + 1, 0 is empty */
 
+    unsigned    slot(void *ptr) const;
+    int         find(void *ptr) const;
+    int         mem_ptr(void *ptr, size_t sz, int external = 0);  /* 0 if bookkeeping failed */
+    void        forget_ptr(int i);
+    void        reindex(void);
+    void        release(void *ptr);
 };
 
 #endif /* C++ */
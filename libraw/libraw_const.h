@@ -158,4 +158,11 @@ enum LibRaw_image_formats
     LIBRAW_IMAGE_BITMAP=2
 };
 
+enum LibRaw_image_layouts
+{
+    LIBRAW_LAYOUT_RGBX=0,       /* ushort[4] per pixel */
+    LIBRAW_LAYOUT_RGB16=1,      /* ushort[3] per pixel */
+    LIBRAW_LAYOUT_PLANAR=2      /* R, G, B planes of width*height ushorts */
+};
+
 #endif
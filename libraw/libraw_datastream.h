@@ -46,6 +46,16 @@ it under the terms of the one of three licenses as you choose:
 #endif
 #endif
 
+/*
+   Define LIBRAW_USE_MMAP_DATASTREAM (Unix only) to use memory-mapped file
+   I/O in LibRaw::open_file().  A mapped file that is truncated, or an NFS
+   page that cannot be read, kills the process with SIGBUS instead of
+   returning LIBRAW_IO_ERROR.
+ */
+#if defined(WIN32) && defined(LIBRAW_USE_MMAP_DATASTREAM)
+#undef LIBRAW_USE_MMAP_DATASTREAM
+#endif
+
 #define IOERROR() do { throw LIBRAW_EXCEPTION_IO_EOF; } while(0)
 
 class LibRaw_buffer_datastream;
@@ -55,7 +65,7 @@ class LibRaw_bit_buffer;
 class DllDef LibRaw_abstract_datastream
 {
   public:
-    LibRaw_abstract_datastream(){ substream=0;};
+    LibRaw_abstract_datastream(){ substream=0; reset_io_stats();};
     virtual             ~LibRaw_abstract_datastream(void){if(substream) delete substream;}
     virtual int         valid() = 0;
     virtual int         read(void *,size_t, size_t ) = 0;
@@ -68,6 +78,11 @@ class DllDef LibRaw_abstract_datastream
     virtual void *      make_jas_stream() = 0;
     /* Make buffer from current offset */
     virtual LibRaw_byte_buffer *make_byte_buffer(unsigned int sz);
+    /* Read sz bytes at given offset, current position is not changed.
+       Returns number of bytes read. Thread-safe in buffer/mmap and fd streams */
+    virtual int         read_at(INT64 offset, void *ptr, size_t sz);
+    /* Hint: data from offset will be read (mostly) sequentially, called by unpack() */
+    virtual void        sequential_hint(INT64 ) {}
 
     /* subfile parsing not implemented in base class */
     virtual const char* fname(){ return NULL;};
@@ -78,8 +93,20 @@ class DllDef LibRaw_abstract_datastream
     virtual int		tempbuffer_open(void*, size_t);
     virtual void	tempbuffer_close();
 
+    /* I/O counters, calls to temporary substream are counted in main stream */
+    const libraw_iostats_t& get_io_stats() { return iostats; }
+    void                reset_io_stats() { memset(&iostats,0,sizeof(iostats)); }
+
   protected:
+    void                count_read(INT64 bytes);
+    void                count_seek(INT64 cur, INT64 o, int whence)
+    {
+        iostats.seek_calls++;
+        if((whence == SEEK_SET && o < cur) || (whence == SEEK_CUR && o < 0))
+            iostats.backward_seeks++;
+    }
     LibRaw_abstract_datastream *substream;
+    libraw_iostats_t    iostats;
 };
 
 #ifdef WIN32
@@ -104,6 +131,7 @@ class DllDef  LibRaw_file_datastream: public LibRaw_abstract_datastream
     virtual INT64       tell();
     virtual int         get_char()
         { 
+            iostats.getchar_calls++;
             if(substream) return substream->get_char();
             return f->sbumpc();  
         }
@@ -123,6 +151,7 @@ class DllDef  LibRaw_buffer_datastream : public LibRaw_abstract_datastream
     virtual void        *make_jas_stream();
     virtual LibRaw_byte_buffer *make_byte_buffer(unsigned int sz);
     virtual int         read(void * ptr,size_t sz, size_t nmemb);
+    virtual int         read_at(INT64 offset, void *ptr, size_t sz);
     virtual int         eof();
     virtual int         seek(INT64 o, int whence);
     virtual INT64       tell();
@@ -130,13 +159,14 @@ class DllDef  LibRaw_buffer_datastream : public LibRaw_abstract_datastream
     virtual int         scanf_one(const char *fmt, void* val);
     virtual int         get_char()
     { 
+        iostats.getchar_calls++;
         if(substream) return substream->get_char();
         if(streampos>=streamsize)
             return -1;
         return buf[streampos++];
     }
 
-  private:
+  protected:
     unsigned char *buf;
     size_t   streampos,streamsize;
 };
@@ -158,8 +188,10 @@ class DllDef LibRaw_bigfile_datastream : public LibRaw_abstract_datastream
     virtual const char *fname();
     virtual int         subfile_open(const char *fn);
     virtual void        subfile_close();
+    virtual void        sequential_hint(INT64 offset);
     virtual int         get_char()
     { 
+        iostats.getchar_calls++;
 #ifndef WIN32
         return substream?substream->get_char():getc_unlocked(f);
 #else
@@ -172,6 +204,134 @@ class DllDef LibRaw_bigfile_datastream : public LibRaw_abstract_datastream
     const char *filename;
 };
 
+#ifdef LIBRAW_USE_MMAP_DATASTREAM
+/* Maps the whole file into memory, byte buffers are views into the mapping */
+class DllDef LibRaw_mmap_datastream : public LibRaw_buffer_datastream
+{
+  public:
+                        LibRaw_mmap_datastream(const char *fname);
+    virtual             ~LibRaw_mmap_datastream();
+    virtual void        *make_jas_stream();
+    virtual int         scanf_one(const char *fmt, void* val);
+    virtual const char* fname();
+    virtual int         subfile_open(const char *fn);
+    virtual void        subfile_close();
+    virtual void        sequential_hint(INT64 offset);
+
+  protected:
+    static void*        map_file(const char *fn, size_t *sz);
+    const char          *filename;
+    unsigned char       *saved_buf;
+    size_t              saved_pos, saved_size;
+};
+#endif
+
+#ifndef WIN32
+/* pread()-based stream over an already opened file descriptor.
+   Caller owns the descriptor, it is not closed by destructor.
+   The descriptor file offset is never used, so several streams
+   (and read_at() callers) may share one descriptor */
+#define LIBRAW_FD_DATASTREAM_BUFSIZE 65536
+/* read-ahead window requested from kernel in sequential mode */
+#define LIBRAW_FD_DATASTREAM_READAHEAD (4*1024*1024)
+class DllDef LibRaw_fd_datastream : public LibRaw_abstract_datastream
+{
+  public:
+                        LibRaw_fd_datastream(int fd);
+    virtual             ~LibRaw_fd_datastream();
+    virtual int         valid();
+    virtual void        *make_jas_stream();
+    virtual int         read(void * ptr,size_t size, size_t nmemb);
+    virtual int         read_at(INT64 offset, void *ptr, size_t sz);
+    virtual int         eof();
+    virtual int         seek(INT64 o, int whence);
+    virtual INT64       tell();
+    virtual char*       gets(char *str, int sz);
+    virtual int         scanf_one(const char *fmt, void*val);
+    virtual void        sequential_hint(INT64 offset);
+    virtual int         get_char()
+    {
+        iostats.getchar_calls++;
+        if(substream) return substream->get_char();
+        if(pos >= bufstart && pos < bufstart + (INT64)buflen)
+            return bufdata[(pos++) - bufstart];
+        if(fill_buffer() < 1)
+            return -1;
+        return bufdata[(pos++) - bufstart];
+    }
+
+  protected:
+    int                 fd_read(void * ptr,size_t size, size_t nmemb);
+    int                 fill_buffer();
+    void                readahead();
+    int                 fd;
+    INT64               pos,fsize;
+    unsigned char       *bufdata;
+    INT64               bufstart;
+    size_t              buflen;
+    INT64               readahead_pos; /* end of requested read-ahead, -1 if not in sequential mode */
+};
+#endif
+
+/* Block cache decorator: keeps LRU list of aligned blocks read from parent
+   stream, so many small scattered reads (metadata parsing) result in few
+   large reads. Reads larger than block are passed to parent directly. */
+#define LIBRAW_CACHED_DATASTREAM_BLOCKSIZE 65536
+#define LIBRAW_CACHED_DATASTREAM_NBLOCKS 16
+class DllDef LibRaw_cached_datastream : public LibRaw_abstract_datastream
+{
+  public:
+    /* parent is deleted in destructor if own_parent is set */
+                        LibRaw_cached_datastream(LibRaw_abstract_datastream *parent, int own_parent=0,
+                                                 unsigned nblocks=LIBRAW_CACHED_DATASTREAM_NBLOCKS);
+    virtual             ~LibRaw_cached_datastream();
+    virtual int         valid();
+    virtual void        *make_jas_stream();
+    virtual int         read(void * ptr,size_t size, size_t nmemb);
+    virtual int         read_at(INT64 offset, void *ptr, size_t sz);
+    virtual int         eof();
+    virtual int         seek(INT64 o, int whence);
+    virtual INT64       tell();
+    virtual char*       gets(char *str, int sz);
+    virtual int         scanf_one(const char *fmt, void*val);
+    virtual const char* fname();
+    virtual int         subfile_open(const char *fn);
+    virtual void        subfile_close();
+    virtual void        sequential_hint(INT64 offset);
+    virtual int         get_char()
+    {
+        iostats.getchar_calls++;
+        if(substream) return substream->get_char();
+        if(cur >= 0 && pos >= blk_offset[cur] && pos < blk_offset[cur] + (INT64)blk_len[cur])
+            return blk_data[cur*(size_t)LIBRAW_CACHED_DATASTREAM_BLOCKSIZE + size_t((pos++) - blk_offset[cur])];
+        unsigned char c;
+        if(cached_read(pos,&c,1) < 1)
+            return -1;
+        pos++;
+        return c;
+    }
+    /* block lookups served from cache / blocks loaded from parent */
+    INT64               cache_hits() { return hits; }
+    INT64               cache_misses() { return misses; }
+    void                cache_flush();
+
+  protected:
+    int                 find_block(INT64 offset);
+    int                 cached_read(INT64 offset, void *ptr, size_t sz);
+    INT64               parent_size();
+    LibRaw_abstract_datastream *parent;
+    int                 own_parent;
+    unsigned            nblocks;
+    unsigned char       *blk_data;
+    INT64               *blk_offset;
+    size_t              *blk_len;
+    unsigned            *blk_used;
+    unsigned            lru_clock;
+    int                 cur;
+    INT64               pos,fsize,saved_pos,saved_fsize;
+    INT64               hits,misses;
+};
+
 #ifdef WIN32
 class DllDef  LibRaw_windows_datastream : public LibRaw_buffer_datastream 
 {
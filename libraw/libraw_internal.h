@@ -61,6 +61,11 @@ public:
     {
          unsigned pad[128], p;
     }sony_decrypt;
+    struct
+    {
+        uchar buf[0x4000];
+        int pos, len;
+    }getbyte;
     uchar jpeg_buffer[4096];
     struct
     {
@@ -71,6 +76,7 @@ public:
     void init() 
         { 
             getbits.bitbuf = 0; getbits.vbits = getbits.reset = 0;
+            getbyte.pos = getbyte.len = 0;
             ph1_bits.bitbuf = 0; ph1_bits.vbits = 0;
             pana_bits.vbits = 0;
         }
@@ -106,6 +112,7 @@ typedef struct
 {
     int         (*histogram)[LIBRAW_HISTOGRAM_SIZE];
     unsigned    *oprof;
+    ushort      *cfa_plane;     /* compact Bayer samples, own block until cfa_to_image() */
 } output_data_t;
 
 typedef struct
@@ -162,6 +169,7 @@ struct tiff_ifd_t
 struct jhead {
   int bits, high, wide, clrs, sraw, psv, restart, vpred[6];
     ushort *huff[6], *free[4], *row;
+    int quiet; /* worker thread: throw on bad data instead of derror() */
 };
 struct tiff_tag {
   ushort tag, type;
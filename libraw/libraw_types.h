@@ -100,6 +100,35 @@ typedef struct
     unsigned             decoder_flags;
 }libraw_decoder_info_t;
 
+typedef struct
+{
+    INT64       bytes_read;         /* read()/read_at() bytes, temporary buffers excluded */
+    INT64       read_calls;
+    INT64       seek_calls;
+    INT64       backward_seeks;
+    INT64       getchar_calls;
+    INT64       bytebuffer_bytes;   /* requested by make_byte_buffer() */
+} libraw_iostats_t;
+
+/*
+   Memory allocator used by a LibRaw instance for its internal buffers.
+   data is passed to every call.  calloc_fn and realloc_fn may be NULL,
+   LibRaw then uses malloc_fn with memset()/memcpy().  release_fn (may be
+   NULL) is called by recycle() after all blocks have been freed.
+ */
+typedef struct
+{
+    void*       (*malloc_fn)(void *data, size_t size);
+    void*       (*calloc_fn)(void *data, size_t n, size_t size);
+    void*       (*realloc_fn)(void *data, void *ptr, size_t size);
+    void        (*free_fn)(void *data, void *ptr);
+    void        (*release_fn)(void *data);
+    void        *data;
+} libraw_allocator_t;
+
+/* bump allocator state, see libraw_arena_create() */
+typedef struct libraw_arena libraw_arena_t;
+
 typedef struct
 {
     unsigned    mix_green;
@@ -304,6 +333,10 @@ typedef struct
     int exp_correc;
     float exp_shift;
     float exp_preser;
+    /* buffer management */
+    int         keep_buffers;   /* recycle() keeps raw/image buffers for reuse */
+    int         compact_bayer;  /* one sample per pixel before demosaic */
+    int         output_layout;  /* LibRaw_image_layouts after convert_to_rgb */
 }libraw_output_params_t;
 
 typedef struct
@@ -337,6 +370,7 @@ typedef struct
     libraw_thumbnail_t          thumbnail;
     libraw_rawdata_t            rawdata;
     ushort                      (*image)[4] ;
+    int                         image_layout;   /* LibRaw_image_layouts */
     libraw_output_params_t     params;
     void                *parent_class;      
 } libraw_data_t;
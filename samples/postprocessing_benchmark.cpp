@@ -50,7 +50,7 @@ int main(int argc, char *argv[])
             printf(
                 "postprocessing benchmark: LibRaw %s sample, %d cameras supported\n"
                 "Measures postprocessing speed with different options\n"
-                "Usage: %s [-a] [-H N] [-q N] [-h] [-m N] [-n N] [-s N] [-B x y w h] [-R N]\n"
+                "Usage: %s [-a] [-H N] [-q N] [-h] [-m N] [-n N] [-s N] [-B x y w h] [-R N] [-u] [-k] [-c]\n"
                 "-a             average image for white balance\n"
                 "-H <num>       Highlight mode (0=clip, 1=unclip, 2=blend, 3+=rebuild)\n"
                 "-q <num>       Set the interpolation quality\n"
@@ -60,6 +60,10 @@ int main(int argc, char *argv[])
                 "-s <num>       Select one raw image from input file\n"
                 "-B <x y w h>   Crop output image\n"
                 "-R <num>       Number of repetitions\n"
+                "-u             Measure unpack() speed instead of postprocessing\n"
+                "-k             Keep raw and image buffers between repetitions\n"
+                "-c             Compact Bayer data before demosaic\n"
+                "-L <num>       Image layout after demosaic (0=RGBX, 1=RGB16, 2=planar)\n"
                 ,LibRaw::version(), LibRaw::cameraCount(),
                 argv[0]);
             return 0;
@@ -67,14 +71,15 @@ int main(int argc, char *argv[])
     char opm,opt,*cp,*sp;
     int arg,c;
     int shrink = 0;
+    int unpack_only = 0;
 
     argv[argc] = (char*)"";
     for (arg=1; (((opm = argv[arg][0]) - 2) | 2) == '+'; ) 
         {
             char *optstr = argv[arg];
             opt = argv[arg++][1];
-            if ((cp = strchr (sp=(char*)"HqmnsBR", opt))!=0)
-                for (i=0; i < "1111141"[cp-sp]-'0'; i++)
+            if ((cp = strchr (sp=(char*)"HqmnsBRL", opt))!=0)
+                for (i=0; i < "11111411"[cp-sp]-'0'; i++)
                     if (!isdigit(argv[arg+i][0]) && !optstr[2]) 
                         {
                             fprintf (stderr,"Non-numeric argument to \"-%c\"\n", opt);
@@ -112,6 +117,18 @@ int main(int argc, char *argv[])
                     rep = abs(atoi(argv[arg++])); 
                     if(rep<1) rep = 1;
                     break;
+                case 'u':
+                    unpack_only = 1;
+                    break;
+                case 'k':
+                    OUT.keep_buffers = 1;
+                    break;
+                case 'c':
+                    OUT.compact_bayer = 1;
+                    break;
+                case 'L':
+                    OUT.output_layout = atoi(argv[arg++]);
+                    break;
                 default:
                     fprintf (stderr,"Unknown option \"-%c\".\n", opt);
                     return 1;
@@ -120,6 +137,32 @@ int main(int argc, char *argv[])
     for ( ; arg < argc; arg++)
         {
             printf("Processing file %s\n",argv[arg]);
+            if(unpack_only)
+                {
+                    float msec = 0;
+                    for(c=0; c < rep; c++)
+                        {
+                            if( (ret = RawProcessor.open_file(argv[arg])) != LIBRAW_SUCCESS)
+                                break;
+                            timerstart();
+                            ret = RawProcessor.unpack();
+                            msec += timerend();
+                            if(ret != LIBRAW_SUCCESS)
+                                break;
+                        }
+                    if(c < rep)
+                        {
+                            fprintf(stderr,"Cannot unpack %s: %s\n",argv[arg],libraw_strerror(ret));
+                            continue;
+                        }
+                    msec /= rep;
+                    float rmpix = (S.raw_width*S.raw_height)/1000000.0f;
+                    printf(
+                        "Performance: %.2f Mpix/sec\n"
+                        "File: %s, Frame: %d %.1f raw Mpix, %.1f msec unpack\n",
+                        rmpix*1000.0f/msec,argv[arg],OUT.shot_select,rmpix,msec);
+                    continue;
+                }
             if( (ret = RawProcessor.open_file(argv[arg])) != LIBRAW_SUCCESS)
                 {
                     fprintf(stderr,"Cannot open_file %s: %s\n",argv[arg],libraw_strerror(ret));
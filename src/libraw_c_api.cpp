@@ -80,6 +80,14 @@ extern "C"
         LibRaw *ip = (LibRaw*) lr->parent_class;
         return ip->open_buffer(buffer,size);
     }
+#ifndef WIN32
+    int libraw_open_fd(libraw_data_t* lr, int fd)
+    {
+        if(!lr) return EINVAL;
+        LibRaw *ip = (LibRaw*) lr->parent_class;
+        return ip->open_fd(fd);
+    }
+#endif
     int libraw_unpack(libraw_data_t* lr)
     {
         if(!lr) return EINVAL;
@@ -196,6 +204,30 @@ extern "C"
         LibRaw *ip = (LibRaw*) lr->parent_class;
         return ip->get_decoder_info(d);
     }
+    int  libraw_get_io_stats(libraw_data_t* lr,libraw_iostats_t *st)
+    {
+        if(!lr || !st) return EINVAL;
+        LibRaw *ip = (LibRaw*) lr->parent_class;
+        return ip->get_io_stats(st);
+    }
+    int  libraw_set_allocator(libraw_data_t* lr,const libraw_allocator_t *a)
+    {
+        if(!lr) return EINVAL;
+        LibRaw *ip = (LibRaw*) lr->parent_class;
+        return ip->set_allocator(a);
+    }
+    int  libraw_set_raw_buffer(libraw_data_t* lr,void *ptr,size_t bytes)
+    {
+        if(!lr) return EINVAL;
+        LibRaw *ip = (LibRaw*) lr->parent_class;
+        return ip->set_raw_buffer(ptr,bytes);
+    }
+    int  libraw_set_image_buffer(libraw_data_t* lr,void *ptr,size_t bytes)
+    {
+        if(!lr) return EINVAL;
+        LibRaw *ip = (LibRaw*) lr->parent_class;
+        return ip->set_image_buffer(ptr,bytes);
+    }
 #ifdef __cplusplus
 }
 #endif
@@ -205,6 +205,9 @@ LibRaw:: LibRaw(unsigned int flags)
     imgdata.params.green_matching = 0;
     imgdata.parent_class = this;
     imgdata.progress_flags = 0;
+    spare_raw = spare_image = spare_hist = NULL;
+    user_raw = user_image = NULL;
+    user_raw_size = user_image_size = 0;
     tls = new LibRaw_TLS;
     tls->init();
 }
@@ -232,6 +235,593 @@ void  LibRaw::      free(void *p)
     memmgr.free(p);
 }
 
+int LibRaw::set_allocator(const libraw_allocator_t *a)
+{
+    // buffers kept by recycle() belong to the old allocator, drop them if nothing else is live
+    void *spares[3] = { spare_raw, spare_image, spare_hist };
+    unsigned nspare = 0;
+    for(int i=0; i < 3; i++)
+        if(spares[i]) nspare++;
+    if(nspare && memmgr.live_blocks() == nspare)
+        {
+            free(spare_raw);
+            free(spare_image);
+            free(spare_hist);
+            spare_raw = spare_image = spare_hist = NULL;
+        }
+    return memmgr.set_allocator(a);
+}
+
+int LibRaw::set_raw_buffer(void *ptr, size_t bytes)
+{
+    if(user_raw && user_raw == imgdata.rawdata.raw_alloc)
+        return LIBRAW_OUT_OF_ORDER_CALL;
+    user_raw = bytes ? ptr : NULL;
+    user_raw_size = user_raw ? bytes : 0;
+    return LIBRAW_SUCCESS;
+}
+
+int LibRaw::set_image_buffer(void *ptr, size_t bytes)
+{
+    if(user_image && user_image == (void*)imgdata.image)
+        return LIBRAW_OUT_OF_ORDER_CALL;
+    user_image = bytes ? ptr : NULL;
+    user_image_size = user_image ? bytes : 0;
+    return LIBRAW_SUCCESS;
+}
+
+// caller's raw buffer if it is large enough
+void* LibRaw::alloc_raw(size_t sz, int zero)
+{
+    if(user_raw && sz <= user_raw_size && memmgr.add_external(user_raw,user_raw_size))
+        {
+            if(zero) memset(user_raw,0,sz);
+            return user_raw;
+        }
+    return take_spare(spare_raw,sz,zero);
+}
+
+// keep the larger of spare and buf as spare, free the other
+void LibRaw::keep_spare(void *&spare, void *buf)
+{
+    if(!buf || buf == spare) return;
+    if(buf == user_raw || buf == user_image)
+        free(buf); // only untracks caller's memory
+    else if(spare && memmgr.block_size(spare) >= memmgr.block_size(buf))
+        free(buf);
+    else
+        {
+            if(spare) free(spare);
+            spare = buf;
+        }
+}
+
+// spare if it is large enough (no page faults), new block otherwise
+void* LibRaw::take_spare(void *&spare, size_t sz, int zero)
+{
+    void *p;
+    if(spare && memmgr.block_size(spare) >= sz)
+        {
+            p = spare;
+            if(zero) memset(p,0,sz);
+        }
+    else
+        {
+            if(spare) free(spare);
+            p = zero ? calloc(sz,1) : malloc(sz);
+        }
+    spare = NULL;
+    return p;
+}
+
+// (re)allocate imgdata.image, zero == 0 if the caller fills every pixel
+void LibRaw::alloc_image(size_t pixels, int zero, const char *where)
+{
+    size_t sz = pixels*sizeof(*imgdata.image);
+    if(imgdata.image)
+        {
+            imgdata.image = (ushort (*)[4]) realloc (imgdata.image,sz);
+            if(imgdata.image && zero)
+                memset(imgdata.image,0,sz);
+        }
+    else if(user_image && sz <= user_image_size && memmgr.add_external(user_image,user_image_size))
+        {
+            imgdata.image = (ushort (*)[4]) user_image;
+            if(zero) memset(imgdata.image,0,sz);
+        }
+    else
+        imgdata.image = (ushort (*)[4]) take_spare(spare_image,sz,zero);
+    merror (imgdata.image, where);
+    imgdata.image_layout = LIBRAW_LAYOUT_RGBX;
+}
+
+// sample c of pixel i is at imgdata.image[0][i*pstep+c*cstep]
+void LibRaw::image_steps(size_t pixels, int *pstep, size_t *cstep)
+{
+    switch(imgdata.image_layout)
+        {
+        case LIBRAW_LAYOUT_RGB16:
+            *pstep = 3; *cstep = 1; break;
+        case LIBRAW_LAYOUT_PLANAR:
+            *pstep = 1; *cstep = pixels; break;
+        default:
+            *pstep = 4; *cstep = 1; break;
+        }
+}
+
+/* Stock allocators */
+
+static void* default_malloc(void *, size_t sz) { return ::malloc(sz); }
+static void* default_calloc(void *, size_t n, size_t sz) { return ::calloc(n,sz); }
+static void* default_realloc(void *, void *p, size_t sz) { return ::realloc(p,sz); }
+static void  default_free(void *, void *p) { ::free(p); }
+
+static const libraw_allocator_t default_allocator = 
+{ default_malloc, default_calloc, default_realloc, default_free, NULL, NULL };
+
+const libraw_allocator_t* libraw_default_allocator()
+{
+    return &default_allocator;
+}
+
+/* data holds the alignment */
+static void* aligned_malloc(void *data, size_t sz)
+{
+#ifdef WIN32
+    return _aligned_malloc(sz ? sz : 1,(size_t)data);
+#else
+    void *p;
+    return posix_memalign(&p,(size_t)data,sz ? sz : 1) ? NULL : p;
+#endif
+}
+
+static void aligned_free(void *, void *p)
+{
+#ifdef WIN32
+    _aligned_free(p);
+#else
+    ::free(p);
+#endif
+}
+
+void libraw_aligned_allocator(libraw_allocator_t *a, size_t alignment)
+{
+    if(!a) return;
+    size_t align = sizeof(void*);
+    while(align < alignment && align < 4096) align <<= 1;
+    memset(a,0,sizeof(*a));
+    a->malloc_fn = aligned_malloc;
+    a->free_fn = aligned_free;
+    a->data = (void*)align;
+}
+
+/*
+   Arena: small blocks are bumped from chunks, blocks larger than a
+   quarter chunk get their own ::malloc().  Freeing the most recent small
+   block rolls the chunk back, other small blocks stay until the release
+   recycle() does once per file.  The first chunk is kept for reuse.
+ */
+#define ARENA_ROUND(x) (((x)+15) & ~(size_t)15)
+
+struct libraw_arena_chunk
+{
+    libraw_arena_chunk  *next;
+    size_t              size, used;
+};
+
+struct libraw_arena_big
+{
+    libraw_arena_big    *prev, *next;
+};
+
+/* precedes every block */
+struct libraw_arena_hdr
+{
+    libraw_arena_big    *big;   /* NULL for chunk blocks */
+    size_t              size;
+};
+
+struct libraw_arena
+{
+    libraw_arena_chunk  *chunks;    /* current chunk first */
+    libraw_arena_big    *bigs;
+    size_t              chunk_size;
+    char                *last;      /* header of the last chunk block */
+};
+
+#define ARENA_HDR       ARENA_ROUND(sizeof(libraw_arena_hdr))
+#define ARENA_CHUNK_HDR ARENA_ROUND(sizeof(libraw_arena_chunk))
+#define ARENA_BIG_HDR   ARENA_ROUND(sizeof(libraw_arena_big))
+
+libraw_arena_t *libraw_arena_create(size_t chunk_size)
+{
+    libraw_arena_t *ar = (libraw_arena_t*)::calloc(1,sizeof(*ar));
+    if(!ar) return NULL;
+    ar->chunk_size = ARENA_ROUND(chunk_size < 65536 ? 65536 : chunk_size);
+    return ar;
+}
+
+static void arena_release(void *data)
+{
+    libraw_arena_t *ar = (libraw_arena_t*)data;
+    while(ar->bigs)
+        {
+            libraw_arena_big *b = ar->bigs;
+            ar->bigs = b->next;
+            ::free(b);
+        }
+    while(ar->chunks && ar->chunks->next)
+        {
+            libraw_arena_chunk *c = ar->chunks;
+            ar->chunks = c->next;
+            ::free(c);
+        }
+    if(ar->chunks) ar->chunks->used = 0;
+    ar->last = NULL;
+}
+
+void libraw_arena_destroy(libraw_arena_t *ar)
+{
+    if(!ar) return;
+    arena_release(ar);
+    ::free(ar->chunks);
+    ::free(ar);
+}
+
+static void* arena_malloc(void *data, size_t sz)
+{
+    libraw_arena_t *ar = (libraw_arena_t*)data;
+    libraw_arena_hdr *h;
+    size_t need = ARENA_HDR + ARENA_ROUND(sz);
+    if(need < sz) return NULL;
+    if(need > ar->chunk_size / 4)
+        {
+            libraw_arena_big *b = (libraw_arena_big*)::malloc(ARENA_BIG_HDR + need);
+            if(!b) return NULL;
+            if((b->next = ar->bigs)) b->next->prev = b;
+            b->prev = NULL;
+            ar->bigs = b;
+            h = (libraw_arena_hdr*)((char*)b + ARENA_BIG_HDR);
+            h->big = b;
+        }
+    else
+        {
+            libraw_arena_chunk *c = ar->chunks;
+            if(!c || c->size - c->used < need)
+                {
+                    if(!(c = (libraw_arena_chunk*)::malloc(ARENA_CHUNK_HDR + ar->chunk_size))) return NULL;
+                    c->size = ar->chunk_size;
+                    c->used = 0;
+                    c->next = ar->chunks;
+                    ar->chunks = c;
+                }
+            h = (libraw_arena_hdr*)((char*)c + ARENA_CHUNK_HDR + c->used);
+            h->big = NULL;
+            c->used += need;
+            ar->last = (char*)h;
+        }
+    h->size = sz;
+    return (char*)h + ARENA_HDR;
+}
+
+static void arena_free(void *data, void *p)
+{
+    libraw_arena_t *ar = (libraw_arena_t*)data;
+    libraw_arena_hdr *h = (libraw_arena_hdr*)((char*)p - ARENA_HDR);
+    if(h->big)
+        {
+            libraw_arena_big *b = h->big;
+            if(b->prev) b->prev->next = b->next; else ar->bigs = b->next;
+            if(b->next) b->next->prev = b->prev;
+            ::free(b);
+        }
+    else if((char*)h == ar->last)
+        {
+            ar->chunks->used -= ARENA_HDR + ARENA_ROUND(h->size);
+            ar->last = NULL;
+        }
+}
+
+static void* arena_realloc(void *data, void *p, size_t sz)
+{
+    libraw_arena_t *ar = (libraw_arena_t*)data;
+    libraw_arena_hdr *h = (libraw_arena_hdr*)((char*)p - ARENA_HDR);
+    if((char*)h == ar->last && ARENA_HDR + ARENA_ROUND(sz) <= ar->chunk_size / 4)
+        {
+            /* last block of the current chunk: grow or shrink in place */
+            libraw_arena_chunk *c = ar->chunks;
+            size_t used = c->used - ARENA_ROUND(h->size) + ARENA_ROUND(sz);
+            if(used <= c->size)
+                {
+                    c->used = used;
+                    h->size = sz;
+                    return p;
+                }
+        }
+    void *np = arena_malloc(data,sz);
+    if(!np) return NULL;
+    memmove(np,p,h->size < sz ? h->size : sz);
+    arena_free(data,p);
+    return np;
+}
+
+void libraw_arena_allocator(libraw_allocator_t *a, libraw_arena_t *ar)
+{
+    if(!a) return;
+    memset(a,0,sizeof(*a));
+    if(!ar) return;
+    a->malloc_fn = arena_malloc;
+    a->realloc_fn = arena_realloc;
+    a->free_fn = arena_free;
+    a->release_fn = arena_release;
+    a->data = ar;
+}
+
+/* libraw_memmgr */
+
+libraw_memmgr::libraw_memmgr()
+    : alloc(default_allocator),blocks(NULL),nblocks(0),maxblocks(0),index(NULL),indexmask(0)
+{
+}
+
+libraw_memmgr::~libraw_memmgr()
+{
+    cleanup();
+    ::free(blocks);
+    ::free(index);
+}
+
+unsigned libraw_memmgr::slot(void *ptr) const
+{
+    return (unsigned)(((size_t)ptr >> 4) * 2654435761U) & indexmask;
+}
+
+/* hash slot holding ptr, -1 if it is not tracked */
+int libraw_memmgr::find(void *ptr) const
+{
+    if(!index) return -1;
+    for(unsigned s = slot(ptr); index[s]; s = (s+1) & indexmask)
+        if(blocks[index[s]-1].ptr == ptr)
+            return s;
+    return -1;
+}
+
+int libraw_memmgr::mem_ptr(void *ptr, size_t sz, int external)
+{
+    unsigned s;
+    if(nblocks >= maxblocks)
+        {
+            /* grow both tables, the hash stays at most half full */
+            unsigned nmax = maxblocks ? maxblocks*2 : 64;
+            block *nb = (block*)::realloc(blocks,nmax*sizeof(*nb));
+            if(!nb) return 0;
+            blocks = nb;
+            unsigned *ni = (unsigned*)::calloc(nmax*2,sizeof(*ni));
+            if(!ni) return 0;
+            maxblocks = nmax;
+            ::free(index);
+            index = ni;
+            indexmask = nmax*2-1;
+            reindex();
+        }
+    for(s = slot(ptr); index[s]; s = (s+1) & indexmask);
+    blocks[nblocks].ptr = ptr;
+    blocks[nblocks].size = sz;
+    blocks[nblocks].external = external;
+    index[s] = ++nblocks;
+    return 1;
+}
+
+void libraw_memmgr::reindex(void)
+{
+    unsigned i, s;
+    memset(index,0,(indexmask+1)*sizeof(*index));
+    for(i=0; i < nblocks; i++)
+        {
+            for(s = slot(blocks[i].ptr); index[s]; s = (s+1) & indexmask);
+            index[s] = i+1;
+        }
+}
+
+void libraw_memmgr::forget_ptr(int hs)
+{
+    unsigned s = hs, j, k, i = index[s]-1;
+    /* backward shift deletion keeps the probe chains intact */
+    index[s] = 0;
+    for(j = s; index[j = (j+1) & indexmask]; )
+        {
+            k = slot(blocks[index[j]-1].ptr);
+            if(j > s ? (k <= s || k > j) : (k <= s && k > j))
+                {
+                    index[s] = index[j];
+                    index[j] = 0;
+                    s = j;
+                }
+        }
+    /* swap-remove from the dense list */
+    if(i != --nblocks)
+        {
+            index[find(blocks[nblocks].ptr)] = i+1;
+            blocks[i] = blocks[nblocks];
+        }
+}
+
+void libraw_memmgr::release(void *ptr)
+{
+    alloc.free_fn(alloc.data,ptr);
+}
+
+/*
+   Decoders allocate from OpenMP threads: the tracker and the allocator
+   behind it are entered by one thread at a time.
+ */
+void *libraw_memmgr::malloc(size_t sz)
+{
+    void *ptr;
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp critical(libraw_memmgr)
+#endif
+    {
+        ptr = alloc.malloc_fn(alloc.data,sz);
+        if(ptr && !mem_ptr(ptr,sz))
+            {
+                release(ptr);
+                ptr = NULL;
+            }
+    }
+    return ptr;
+}
+
+void *libraw_memmgr::calloc(size_t n, size_t sz)
+{
+    void *ptr;
+    if(sz && n > ((size_t)-1) / sz) return NULL;
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp critical(libraw_memmgr)
+#endif
+    {
+        if(alloc.calloc_fn)
+            ptr = alloc.calloc_fn(alloc.data,n,sz);
+        else if((ptr = alloc.malloc_fn(alloc.data,n*sz)))
+            memset(ptr,0,n*sz);
+        if(ptr && !mem_ptr(ptr,n*sz))
+            {
+                release(ptr);
+                ptr = NULL;
+            }
+    }
+    return ptr;
+}
+
+void *libraw_memmgr::realloc(void *ptr, size_t newsz)
+{
+    void *ret = NULL;
+    if(!ptr) return malloc(newsz);
+    if(!newsz)
+        {
+            free(ptr);
+            return NULL;
+        }
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp critical(libraw_memmgr)
+#endif
+    {
+        int s = find(ptr);
+        if(s < 0)
+            ret = ::realloc(ptr,newsz);
+        else if(blocks[index[s]-1].external)
+            {
+                size_t oldsz = blocks[index[s]-1].size;
+                if(newsz <= oldsz)
+                    ret = ptr;
+                else if((ret = alloc.malloc_fn(alloc.data,newsz)))
+                    {
+                        memmove(ret,ptr,oldsz);
+                        forget_ptr(s);
+                        mem_ptr(ret,newsz);
+                    }
+            }
+        else
+            {
+                size_t oldsz = blocks[index[s]-1].size;
+                if(alloc.realloc_fn)
+                    ret = alloc.realloc_fn(alloc.data,ptr,newsz);
+                else if((ret = alloc.malloc_fn(alloc.data,newsz)))
+                    {
+                        memmove(ret,ptr,oldsz < newsz ? oldsz : newsz);
+                        release(ptr);
+                    }
+                if(ret)
+                    {
+                        /* one entry out, one in: the tables do not grow */
+                        forget_ptr(s);
+                        mem_ptr(ret,newsz);
+                    }
+            }
+    }
+    return ret;
+}
+
+void libraw_memmgr::free(void *ptr)
+{
+    if(!ptr) return;
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp critical(libraw_memmgr)
+#endif
+    {
+        int s = find(ptr);
+        if(s < 0)
+            ::free(ptr);
+        else
+            {
+                int external = blocks[index[s]-1].external;
+                forget_ptr(s);
+                if(!external)
+                    release(ptr);
+            }
+    }
+}
+
+size_t libraw_memmgr::block_size(void *ptr)
+{
+    size_t sz = 0;
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp critical(libraw_memmgr)
+#endif
+    {
+        int s = ptr ? find(ptr) : -1;
+        if(s >= 0)
+            sz = blocks[index[s]-1].size;
+    }
+    return sz;
+}
+
+int libraw_memmgr::add_external(void *ptr, size_t sz)
+{
+    int ret = 0;
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp critical(libraw_memmgr)
+#endif
+    {
+        if(ptr && find(ptr) < 0)
+            ret = mem_ptr(ptr,sz,1);
+    }
+    return ret;
+}
+
+void libraw_memmgr::cleanup(void *const *keep, int nkeep)
+{
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp critical(libraw_memmgr)
+#endif
+    {
+        unsigned i, kept = 0;
+        int k;
+        for(i=0; i < nblocks; i++)
+            {
+                for(k=0; k < nkeep && keep[k] != blocks[i].ptr; k++);
+                if(k < nkeep)
+                    blocks[kept++] = blocks[i];
+                else if(!blocks[i].external)
+                    release(blocks[i].ptr);
+            }
+        nblocks = kept;
+        if(index) reindex();
+        if(alloc.release_fn)
+            alloc.release_fn(alloc.data);
+    }
+}
+
+int libraw_memmgr::set_allocator(const libraw_allocator_t *a)
+{
+    if(a && (!a->malloc_fn || !a->free_fn))
+        return LIBRAW_UNSPECIFIED_ERROR;
+    if(nblocks)
+        return LIBRAW_OUT_OF_ORDER_CALL;
+    alloc = a ? *a : default_allocator;
+    return LIBRAW_SUCCESS;
+}
+
 
 int LibRaw:: fc (int row, int col)
 {
@@ -266,8 +856,26 @@ void LibRaw:: recycle()
         }
     libraw_internal_data.internal_data.input_internal = 0;
 #define FREE(a) do { if(a) { free(a); a = NULL;} }while(0)
+    if(imgdata.image == imgdata.rawdata.raw_alloc) // legacy decoder buffer
+        imgdata.image = NULL;
+    if(O.keep_buffers && !memmgr.allocator().release_fn)
+        {
+            keep_spare(spare_raw,imgdata.rawdata.raw_alloc);
+            keep_spare(spare_image,imgdata.image);
+            keep_spare(spare_hist,libraw_internal_data.output_data.histogram);
+            imgdata.rawdata.raw_alloc = NULL;
+            imgdata.image = NULL;
+            libraw_internal_data.output_data.histogram = NULL;
+        }
+    else
+        {
+            FREE(spare_raw);
+            FREE(spare_image);
+            FREE(spare_hist);
+        }
             
     FREE(imgdata.image); 
+    imgdata.image_layout = LIBRAW_LAYOUT_RGBX;
     FREE(imgdata.thumbnail.thumb);
     FREE(libraw_internal_data.internal_data.meta_data);
     FREE(libraw_internal_data.output_data.histogram);
@@ -280,13 +888,26 @@ void LibRaw:: recycle()
     ZERO(imgdata.sizes);
     ZERO(imgdata.color);
     ZERO(libraw_internal_data);
-    memmgr.cleanup();
+    void *spares[3] = { spare_raw, spare_image, spare_hist };
+    memmgr.cleanup(spares,3);
     imgdata.thumbnail.tformat = LIBRAW_THUMBNAIL_UNKNOWN;
     imgdata.progress_flags = 0;
     
     tls->init();
 }
 
+int LibRaw::get_io_stats(libraw_iostats_t* st)
+{
+    if(!st) return LIBRAW_UNSPECIFIED_ERROR;
+    if(!libraw_internal_data.internal_data.input)
+        {
+            memset(st,0,sizeof(*st));
+            return LIBRAW_OUT_OF_ORDER_CALL;
+        }
+    memmove(st,&libraw_internal_data.internal_data.input->get_io_stats(),sizeof(*st));
+    return LIBRAW_SUCCESS;
+}
+
 const char * LibRaw::unpack_function_name()
 {
     libraw_decoder_info_t decoder_info;
@@ -573,12 +1194,24 @@ int LibRaw::open_file(const char *fname, INT64 max_buf_size)
     int big = (st.st_size > max_buf_size)?1:0;
 #endif
 
-    LibRaw_abstract_datastream *stream;
+    LibRaw_abstract_datastream *stream = NULL;
     try {
-        if(big)
-         stream = new LibRaw_bigfile_datastream(fname);
-        else
-         stream = new LibRaw_file_datastream(fname);
+#ifdef LIBRAW_USE_MMAP_DATASTREAM
+        stream = new LibRaw_mmap_datastream(fname);
+        if(!stream->valid())
+            {
+                // mmap() failed (empty or special file), fall back to stdio
+                delete stream;
+                stream = NULL;
+            }
+#endif
+        if(!stream)
+            {
+                if(big)
+                    stream = new LibRaw_bigfile_datastream(fname);
+                else
+                    stream = new LibRaw_file_datastream(fname);
+            }
     }
 
     catch (std::bad_alloc)
@@ -639,6 +1272,41 @@ int LibRaw::open_buffer(void *buffer, size_t size)
     return ret;
 }
 
+#ifndef WIN32
+int LibRaw::open_fd(int fd)
+{
+    // this stream will be deleted on recycle(), fd remains open
+    if(fd < 0)
+        return LIBRAW_IO_ERROR;
+
+    LibRaw_fd_datastream *stream;
+    try {
+        stream = new LibRaw_fd_datastream(fd);
+    }
+    catch (std::bad_alloc)
+        {
+            recycle();
+            return LIBRAW_UNSUFFICIENT_MEMORY;
+        }
+    if(!stream->valid())
+        {
+            delete stream;
+            return LIBRAW_IO_ERROR;
+        }
+    ID.input_internal = 0; // preserve from deletion on error
+    int ret = open_datastream(stream);
+    if (ret == LIBRAW_SUCCESS)
+        {
+            ID.input_internal =1 ; // flag to delete datastream on recycle
+        }
+    else
+        {
+            delete stream;
+            ID.input_internal = 0;
+        }
+    return ret;
+}
+#endif
 
 int LibRaw::open_datastream(LibRaw_abstract_datastream *stream)
 {
@@ -648,6 +1316,7 @@ int LibRaw::open_datastream(LibRaw_abstract_datastream *stream)
     if(!stream->valid())
         return LIBRAW_IO_ERROR;
     recycle();
+    stream->reset_io_stats();
 
     try {
         ID.input = stream;
@@ -733,7 +1402,10 @@ int LibRaw::unpack(void)
         // already allocated ?
         if(imgdata.image)
             {
-                free(imgdata.image);
+                if(O.keep_buffers)
+                    keep_spare(spare_image,imgdata.image);
+                else
+                    free(imgdata.image);
                 imgdata.image = 0;
             }
 
@@ -744,6 +1416,7 @@ int LibRaw::unpack(void)
                 merror (libraw_internal_data.internal_data.meta_data, "LibRaw::unpack()");
             }
         ID.input->seek(libraw_internal_data.unpacker_data.data_offset, SEEK_SET);
+        ID.input->sequential_hint(libraw_internal_data.unpacker_data.data_offset);
         int save_document_mode = O.document_mode;
         O.document_mode = 0;
 
@@ -764,7 +1437,7 @@ int LibRaw::unpack(void)
         
         if(decoder_info.decoder_flags &  LIBRAW_DECODER_FLATFIELD)
             {
-                imgdata.rawdata.raw_alloc = malloc(rwidth*rheight*sizeof(imgdata.rawdata.raw_image[0]));
+                imgdata.rawdata.raw_alloc = alloc_raw(rwidth*rheight*sizeof(imgdata.rawdata.raw_image[0]),0);
                 imgdata.rawdata.raw_image = (ushort*) imgdata.rawdata.raw_alloc;
             }
         else if (decoder_info.decoder_flags &  LIBRAW_DECODER_4COMPONENT)
@@ -772,7 +1445,7 @@ int LibRaw::unpack(void)
                 S.iwidth = S.width;
                 S.iheight= S.height;
                 IO.shrink = 0;
-                imgdata.rawdata.raw_alloc = calloc(rwidth*rheight,sizeof(*imgdata.rawdata.color_image));
+                imgdata.rawdata.raw_alloc = alloc_raw(rwidth*rheight*sizeof(*imgdata.rawdata.color_image),1);
                 imgdata.rawdata.color_image = (ushort(*)[4]) imgdata.rawdata.raw_alloc;
             }
         else if (decoder_info.decoder_flags & LIBRAW_DECODER_LEGACY)
@@ -783,7 +1456,7 @@ int LibRaw::unpack(void)
                 S.iheight= S.height;
                 IO.shrink = 0;
                 // allocate image as temporary buffer, size 
-                imgdata.rawdata.raw_alloc = calloc(S.iwidth*S.iheight,sizeof(*imgdata.image));
+                imgdata.rawdata.raw_alloc = alloc_raw(S.iwidth*S.iheight*sizeof(*imgdata.image),1);
                 imgdata.image = (ushort (*)[4]) imgdata.rawdata.raw_alloc;
             }
 
@@ -891,7 +1564,10 @@ void LibRaw::free_image(void)
 {
     if(imgdata.image)
         {
-            free(imgdata.image);
+            if(O.keep_buffers)
+                keep_spare(spare_image,imgdata.image);
+            else
+                free(imgdata.image);
             imgdata.image = 0;
             imgdata.progress_flags 
                 = LIBRAW_PROGRESS_START|LIBRAW_PROGRESS_OPEN
@@ -927,6 +1603,11 @@ void LibRaw::raw2image_start()
 
         if (O.user_black >= 0) 
             C.black = O.user_black;
+
+        // compact Bayer plane left by an interrupted dcraw_process()
+        if(libraw_internal_data.output_data.cfa_plane)
+            free(libraw_internal_data.output_data.cfa_plane);
+        libraw_internal_data.output_data.cfa_plane = NULL;
 }
 
 // Same as raw2image, but
@@ -994,14 +1675,7 @@ int LibRaw::raw2image_ex(void)
 
             fiheight = (IO.fheight + IO.shrink) >> IO.shrink;
             fiwidth = (IO.fwidth + IO.shrink) >> IO.shrink;
-            if(imgdata.image)
-                    {
-                        imgdata.image = (ushort (*)[4])realloc(imgdata.image,fiheight*fiwidth*sizeof (*imgdata.image));
-                        memset(imgdata.image,0,fiheight*fiwidth *sizeof (*imgdata.image));
-                    }
-                else
-                    imgdata.image = (ushort (*)[4]) calloc (fiheight*fiwidth, sizeof (*imgdata.image));
-            merror (imgdata.image, "raw2image_ex()");
+            alloc_image(fiheight*fiwidth,1,"raw2image_ex()");
 
             int cblk[4],i;
             for(i=0;i<4;i++)
@@ -1047,38 +1721,39 @@ int LibRaw::raw2image_ex(void)
     else
         {
 
-                if(imgdata.image)
-                    {
-                        imgdata.image = (ushort (*)[4]) realloc (imgdata.image,S.iheight*S.iwidth 
-                                                                 *sizeof (*imgdata.image));
-                        memset(imgdata.image,0,S.iheight*S.iwidth *sizeof (*imgdata.image));
-                    }
-                else
-                    imgdata.image = (ushort (*)[4]) calloc (S.iheight*S.iwidth, sizeof (*imgdata.image));
-
-                merror (imgdata.image, "raw2image_ex()");
-                
                 libraw_decoder_info_t decoder_info;
                 get_decoder_info(&decoder_info);
 
+                // unshrunk flat-field, 4-component and legacy copies below fill every pixel
+                alloc_image(S.iheight*S.iwidth,
+                            IO.shrink || !(decoder_info.decoder_flags 
+                                           & (LIBRAW_DECODER_FLATFIELD|LIBRAW_DECODER_4COMPONENT|LIBRAW_DECODER_LEGACY)),
+                            "raw2image_ex()");
 
                 if(decoder_info.decoder_flags & LIBRAW_DECODER_FLATFIELD)
                     {
+                        // not zero-filled when unshrunk: clear each row while it is in cache
                         if(decoder_info.decoder_flags & LIBRAW_DECODER_USEBAYER2)
 #if defined(LIBRAW_USE_OPENMP)
 #pragma omp parallel for default(shared)
 #endif
                             for(int row = 0; row < S.height; row++)
-                                for(int col = 0; col < S.width; col++)
-                                    imgdata.image[(row >> IO.shrink)*S.iwidth + (col>>IO.shrink)][fc(row,col)]
-                                        = imgdata.rawdata.raw_image[(row+S.top_margin)*S.raw_width
-                                                                    +(col+S.left_margin)];
+                                {
+                                    if(!IO.shrink)
+                                        memset(&imgdata.image[row*S.iwidth],0,S.iwidth*sizeof(*imgdata.image));
+                                    for(int col = 0; col < S.width; col++)
+                                        imgdata.image[(row >> IO.shrink)*S.iwidth + (col>>IO.shrink)][fc(row,col)]
+                                            = imgdata.rawdata.raw_image[(row+S.top_margin)*S.raw_width
+                                                                        +(col+S.left_margin)];
+                                }
                         else
 #if defined(LIBRAW_USE_OPENMP)
 #pragma omp parallel for default(shared)
 #endif
                             for(int row = 0; row < S.height; row++)
                                 {
+                                    if(!IO.shrink)
+                                        memset(&imgdata.image[row*S.iwidth],0,S.iwidth*sizeof(*imgdata.image));
                                     int colors[2];
                                     for (int xx=0;xx<2;xx++)
                                         colors[xx] = COLOR(row,xx);
@@ -1138,7 +1813,103 @@ int LibRaw::raw2image_ex(void)
 
 #undef MIN
 
+/*
+   Bayer data for dcraw_process(): one sample per pixel in a buffer of
+   its own, imgdata.image is not allocated yet.  scale_colors() and
+   green_matching() work on it, cfa_to_image() grows it into the image
+   before pre_interpolate().  Returns 0 (nothing done) if the data does
+   not fit: shrink, Fuji, crop, 4-component or non-2x2 patterns.
+ */
+int LibRaw::raw2image_cfa(void)
+{
+    libraw_decoder_info_t decoder_info;
+    int row, col, mask = 0;
 
+    raw2image_start();
+    get_decoder_info(&decoder_info);
+    if(IO.fuji_width || IO.shrink || IO.zero_is_bad || P1.colors != 3 || P1.filters < 1000
+       || !(decoder_info.decoder_flags & LIBRAW_DECODER_FLATFIELD) 
+       || imgdata.rawdata.use_ph1_correct || (~O.cropbox[2] && ~O.cropbox[3]))
+        return 0;
+    for(row=0; row < 8; row++)
+        for(col=0; col < 2; col++)
+            {
+                if(FC(row,col) != FC(row&1,col)) return 0;
+                mask |= 1 << FC(row,col);
+            }
+    if(mask != 15) return 0;
+
+    size_t pixels = (size_t)S.iheight*S.iwidth;
+    if(imgdata.image)
+        {
+            if(O.keep_buffers)
+                keep_spare(spare_image,imgdata.image);
+            else
+                free(imgdata.image);
+            imgdata.image = NULL;
+        }
+    ushort *cfa = (ushort *) take_spare(spare_image,pixels*sizeof(*cfa),0);
+    merror(cfa,"raw2image_cfa()");
+#if defined(LIBRAW_USE_OPENMP)
+#pragma omp parallel for default(shared)
+#endif
+    for(row = 0; row < S.height; row++)
+        memmove(cfa + row*S.iwidth,
+                imgdata.rawdata.raw_image + (row+S.top_margin)*S.raw_width + S.left_margin,
+                S.width*sizeof(*cfa));
+    libraw_internal_data.output_data.cfa_plane = cfa;
+    return 1;
+}
+
+void LibRaw::cfa_row_to_image(int row)
+{
+    const ushort *src = libraw_internal_data.output_data.cfa_plane + row*S.iwidth;
+    ushort (*dst)[4] = imgdata.image + row*S.iwidth;
+    int rc[2] = { FC(row,0), FC(row,1) };
+    for(int col = 0; col < S.iwidth; col++)
+        {
+            ushort quad[4] = { 0,0,0,0 };
+            quad[rc[col&1]] = src[col];
+            memcpy(dst[col],quad,sizeof(quad));
+        }
+}
+
+/*
+   The plane is grown to the image size and moved to its last quarter.
+   Then in place: pixel i overwrites samples 4i-3N..4i-3N+3 (N pixels), so
+   going forward only consumed samples are lost.  Rows [row,end) with
+   end*width <= (row*width+3N)/4 do not touch each other's samples and
+   are expanded in parallel; the few rows left near the end go one by one.
+ */
+void LibRaw::cfa_to_image(void)
+{
+    ushort *&plane = libraw_internal_data.output_data.cfa_plane;
+    if(!plane) return;
+    size_t pixels = (size_t)S.iheight*S.iwidth;
+    imgdata.image = (ushort (*)[4]) realloc(plane,pixels*sizeof(*imgdata.image));
+    merror(imgdata.image,"cfa_to_image()");
+    imgdata.image_layout = LIBRAW_LAYOUT_RGBX;
+    plane = imgdata.image[0] + pixels*3;
+    memmove(plane,imgdata.image[0],pixels*sizeof(*plane));
+    int row = 0;
+    while(row < S.iheight)
+        {
+            int end = ((size_t)row*S.iwidth + pixels*3)/4/S.iwidth;
+            if(end > S.iheight) end = S.iheight;
+            if(end <= row+1)
+                {
+                    cfa_row_to_image(row++);
+                    continue;
+                }
+#if defined(LIBRAW_USE_OPENMP)
+#pragma omp parallel for default(shared)
+#endif
+            for(int r = row; r < end; r++)
+                cfa_row_to_image(r);
+            row = end;
+        }
+    libraw_internal_data.output_data.cfa_plane = NULL;
+}
 
 
 int LibRaw::raw2image(void)
@@ -1150,15 +1921,7 @@ int LibRaw::raw2image(void)
         raw2image_start();
 
         // free and re-allocate image bitmap
-        if(imgdata.image)
-            {
-                imgdata.image = (ushort (*)[4]) realloc (imgdata.image,S.iheight*S.iwidth *sizeof (*imgdata.image));
-                memset(imgdata.image,0,S.iheight*S.iwidth *sizeof (*imgdata.image));
-            }
-        else
-            imgdata.image = (ushort (*)[4]) calloc (S.iheight*S.iwidth, sizeof (*imgdata.image));
-
-        merror (imgdata.image, "raw2image()");
+        alloc_image(S.iheight*S.iwidth,1,"raw2image()");
 
         libraw_decoder_info_t decoder_info;
         get_decoder_info(&decoder_info);
@@ -1321,7 +2084,7 @@ int LibRaw::dcraw_document_mode_processing(void)
 #endif
         if(!libraw_internal_data.output_data.histogram)
             {
-                libraw_internal_data.output_data.histogram = (int (*)[LIBRAW_HISTOGRAM_SIZE]) malloc(sizeof(*libraw_internal_data.output_data.histogram)*4);
+                libraw_internal_data.output_data.histogram = (int (*)[LIBRAW_HISTOGRAM_SIZE]) take_spare(spare_hist,sizeof(*libraw_internal_data.output_data.histogram)*4,0);
                 merror(libraw_internal_data.output_data.histogram,"LibRaw::dcraw_document_mode_processing()");
             }
         convert_to_rgb();
@@ -1483,6 +2246,9 @@ int LibRaw::copy_mem_image(void* scan0, int stride, int bgr)
     uchar *ppm;
     ushort *ppm2;
     int c, row, col, soff, rstep, cstep;
+    ushort *img = imgdata.image[0];
+    int ps; size_t cs;
+    image_steps((size_t)S.iheight*S.iwidth,&ps,&cs);
 
     soff  = flip_index (0, 0);
     cstep = flip_index (0, 1) - soff;
@@ -1496,21 +2262,21 @@ int LibRaw::copy_mem_image(void* scan0, int stride, int bgr)
             if (bgr) {
                 if (O.output_bps == 8) {
                     for (col=0; col < S.width; col++, soff += cstep) 
-                        FORBGR *ppm++ = imgdata.color.curve[imgdata.image[soff][c]]>>8;
+                        FORBGR *ppm++ = imgdata.color.curve[img[soff*ps+c*cs]]>>8;
                 }
                 else {
                     for (col=0; col < S.width; col++, soff += cstep) 
-                        FORBGR *ppm2++ = imgdata.color.curve[imgdata.image[soff][c]];
+                        FORBGR *ppm2++ = imgdata.color.curve[img[soff*ps+c*cs]];
                 }
             }
             else {
                 if (O.output_bps == 8) {
                     for (col=0; col < S.width; col++, soff += cstep) 
-                        FORRGB *ppm++ = imgdata.color.curve[imgdata.image[soff][c]]>>8;
+                        FORRGB *ppm++ = imgdata.color.curve[img[soff*ps+c*cs]]>>8;
                 }
                 else {
                     for (col=0; col < S.width; col++, soff += cstep) 
-                        FORRGB *ppm2++ = imgdata.color.curve[imgdata.image[soff][c]];
+                        FORRGB *ppm2++ = imgdata.color.curve[img[soff*ps+c*cs]];
                 }
             }
 
@@ -1582,7 +2348,7 @@ int LibRaw::dcraw_ppm_tiff_writer(const char *filename)
         if(!libraw_internal_data.output_data.histogram)
             {
                 libraw_internal_data.output_data.histogram = 
-                    (int (*)[LIBRAW_HISTOGRAM_SIZE]) malloc(sizeof(*libraw_internal_data.output_data.histogram)*4);
+                    (int (*)[LIBRAW_HISTOGRAM_SIZE]) take_spare(spare_hist,sizeof(*libraw_internal_data.output_data.histogram)*4,0);
                 merror(libraw_internal_data.output_data.histogram,"LibRaw::dcraw_ppm_tiff_writer()");
             }
         libraw_internal_data.internal_data.output = f;
@@ -2077,7 +2843,8 @@ int LibRaw::dcraw_process(void)
         if (~O.cropbox[2] && ~O.cropbox[3])
             no_crop=0;
 
-        raw2image_ex(); // raw2image+crop+rotate_fuji_raw + subtract_black for fuji
+        if(!O.compact_bayer || O.bad_pixels || O.dark_frame || !raw2image_cfa())
+            raw2image_ex(); // raw2image+crop+rotate_fuji_raw + subtract_black for fuji
 
         int save_4color = O.four_color_rgb;
 
@@ -2131,6 +2898,7 @@ int LibRaw::dcraw_process(void)
                 SET_PROC_FLAG(LIBRAW_PROGRESS_SCALE_COLORS);
             }
 
+        cfa_to_image();
         pre_interpolate();
 
         SET_PROC_FLAG(LIBRAW_PROGRESS_PRE_INTERPOLATE);
@@ -2232,7 +3000,7 @@ int LibRaw::dcraw_process(void)
     
         if(!libraw_internal_data.output_data.histogram)
             {
-                libraw_internal_data.output_data.histogram = (int (*)[LIBRAW_HISTOGRAM_SIZE]) malloc(sizeof(*libraw_internal_data.output_data.histogram)*4);
+                libraw_internal_data.output_data.histogram = (int (*)[LIBRAW_HISTOGRAM_SIZE]) take_spare(spare_hist,sizeof(*libraw_internal_data.output_data.histogram)*4,0);
                 merror(libraw_internal_data.output_data.histogram,"LibRaw::dcraw_process()");
             }
 #ifndef NO_LCMS
@@ -2253,6 +3021,19 @@ int LibRaw::dcraw_process(void)
             }
         O.four_color_rgb = save_4color; // also, restore
 
+        // shrink, fuji_rotate() and stretch() reallocate: move result to caller's buffer
+        if(user_image && (void*)imgdata.image != user_image)
+            {
+                size_t sz = (size_t)S.width*S.height*sizeof(ushort)
+                    *(imgdata.image_layout == LIBRAW_LAYOUT_RGBX ? 4 : 3);
+                if(sz <= user_image_size && memmgr.add_external(user_image,user_image_size))
+                    {
+                        memmove(user_image,imgdata.image,sz);
+                        free(imgdata.image);
+                        imgdata.image = (ushort (*)[4]) user_image;
+                    }
+            }
+
         return 0;
     }
     catch ( LibRaw_exceptions err) {
@@ -3,10 +3,19 @@
 #include "internal/defines.h"
 #include "libraw/libraw_datastream.h"
 #include "internal/libraw_bytebuffer.h"
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#ifdef LIBRAW_USE_MMAP_DATASTREAM
+#include <sys/mman.h>
+#endif
 
 LibRaw_byte_buffer::LibRaw_byte_buffer(unsigned sz) 
 { 
     buf=0; size=sz; offt=0; do_free=0; 
+    lj=0; lj_pos=lj_len=lj_fill=lj_stop=0;
     if(size)
         { 
             buf = (unsigned char*)malloc(size); do_free=1;
@@ -16,20 +25,140 @@ LibRaw_byte_buffer::LibRaw_byte_buffer(unsigned sz)
 void LibRaw_byte_buffer::set_buffer(void *bb, unsigned int sz) 
 { 
     buf = (unsigned char*)bb; size = sz; offt=0; do_free=0;
+    lj_pos=lj_len=lj_fill=lj_stop=0;
+}
+
+// view of src starting at offset from, src keeps the ownership
+void LibRaw_byte_buffer::set_buffer(LibRaw_byte_buffer *src, unsigned int from)
+{
+    if(from > src->size) from = src->size;
+    set_buffer(src->buf+from,src->size-from);
 }
 
 LibRaw_byte_buffer::~LibRaw_byte_buffer() 
 { 
     if(do_free) free(buf);
+    if(lj) free(lj);
+}
+
+// Refill the destuffed window from the raw entropy-coded data. Unread tail
+// bytes are kept, 0xFF00 pairs become 0xFF, and the window stops at the first
+// marker. Past a marker (or the end of data) the window is padded with zero
+// bytes, so the bit reader can always load a whole 64-bit word.
+void LibRaw_byte_buffer::ljpeg_fill()
+{
+    if(!lj)
+        {
+            lj = (unsigned char*)malloc(LIBRAW_LJPEG_WINDOW+16);
+            if(!lj) throw LIBRAW_EXCEPTION_ALLOC;
+        }
+    if(lj_pos < lj_len)
+        {
+            memmove(lj,lj+lj_pos,lj_len-lj_pos);
+            lj_len -= lj_pos;
+        }
+    else
+        lj_len = 0;
+    lj_pos = 0;
+    while(!lj_stop && offt < size && lj_len < LIBRAW_LJPEG_WINDOW)
+        {
+            unsigned room = LIBRAW_LJPEG_WINDOW - lj_len, left = size - offt;
+            unsigned n = left < room ? left : room;
+            unsigned char *ff = (unsigned char*)memchr(buf+offt,0xff,n);
+            unsigned run = ff ? ff - (buf+offt) : n;
+            memcpy(lj+lj_len,buf+offt,run);
+            lj_len += run;
+            offt += run;
+            if(!ff) continue;
+            if(offt+1 >= size)
+                {
+                    // trailing 0xFF is data
+                    lj[lj_len++] = 0xff;
+                    offt++;
+                }
+            else if(buf[offt+1] == 0)
+                {
+                    lj[lj_len++] = 0xff;
+                    offt += 2;
+                }
+            else
+                lj_stop = 1;
+        }
+    lj_fill = lj_len;
+    if(lj_stop || offt >= size)
+        {
+            memset(lj+lj_len,0,8);
+            lj_fill += 8;
+        }
+}
+
+// Skip to the entropy-coded data after the next RSTn (or any 0xFFDx) marker
+void LibRaw_byte_buffer::ljpeg_restart()
+{
+    unsigned short mark=0;
+    int c;
+    do mark = (mark << 8) + (c = get_byte());
+    while (c != EOF && mark >> 4 != 0xffd);
+    lj_pos=lj_len=lj_fill=lj_stop=0;
+}
+
+// Offsets of the markers found by successive ljpeg_restart() calls: pos[0]
+// is the start of data, pos[i] the 0xFFDx pair that opens interval i, or
+// the buffer size if there is none
+void LibRaw_byte_buffer::ljpeg_restarts(unsigned *pos, int count)
+{
+    unsigned p = 0;
+    pos[0] = 0;
+    for(int i=1; i < count; i++)
+        {
+            unsigned char *ff = 0;
+            while(p < size && (ff = (unsigned char*)memchr(buf+p,0xff,size-p)))
+                {
+                    p = ff - buf;
+                    if(p+1 < size && (buf[p+1] & 0xf0) == 0xd0)
+                        break;
+                    ff = 0;
+                    p++;
+                }
+            if(!ff) p = size;
+            pos[i] = p;
+            if(p < size) p += 2;
+        }
 }
 
 LibRaw_byte_buffer *LibRaw_abstract_datastream::make_byte_buffer(unsigned int sz)
 {
     LibRaw_byte_buffer *ret = new LibRaw_byte_buffer(sz);
+    iostats.bytebuffer_bytes += sz;
     read(ret->get_buffer(),sz,1);
     return ret;
 }
 
+int LibRaw_abstract_datastream::read_at(INT64 offset, void *ptr, size_t sz)
+{
+    INT64 saved = tell();
+    seek(offset,SEEK_SET);
+    int ret = read(ptr,1,sz);
+    seek(saved,SEEK_SET);
+    return ret;
+}
+
+// read_at() may run on several threads, so the counters are updated atomically
+void LibRaw_abstract_datastream::count_read(INT64 bytes)
+{
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp atomic
+#endif
+    iostats.read_calls++;
+    if(bytes > 0)
+        {
+#ifdef LIBRAW_USE_OPENMP
+#pragma omp atomic
+#endif
+            iostats.bytes_read += bytes;
+        }
+}
+
 int LibRaw_abstract_datastream::tempbuffer_open(void  *buf, size_t size)
 {
     if(substream) return EBUSY;
@@ -66,14 +195,22 @@ LibRaw_file_datastream::LibRaw_file_datastream(const char *fname)
 
 int LibRaw_file_datastream::read(void * ptr,size_t size, size_t nmemb)
 {
-    if(substream) return substream->read(ptr,size,nmemb);
-    
+    int ret;
+    if(substream) 
+        ret = substream->read(ptr,size,nmemb);
+    else
+        {
+            LR_STREAM_CHK();
 /* Visual Studio 2008 marks sgetn as insecure, but VS2010 does not. */
 #if defined(WIN32SECURECALLS) && (_MSC_VER < 1600)
-    LR_STREAM_CHK(); return int(f->_Sgetn_s(static_cast<char*>(ptr), nmemb * size,nmemb * size) / size); 
+            std::streamsize got = f->_Sgetn_s(static_cast<char*>(ptr), nmemb * size,nmemb * size);
 #else
-    LR_STREAM_CHK(); return int(f->sgetn(static_cast<char*>(ptr), std::streamsize(nmemb * size)) / size); 
+            std::streamsize got = f->sgetn(static_cast<char*>(ptr), std::streamsize(nmemb * size));
 #endif
+            ret = int(got / size); 
+        }
+    count_read(INT64(ret)*size);
+    return ret;
 }
 
 int LibRaw_file_datastream::eof() 
@@ -84,6 +221,7 @@ int LibRaw_file_datastream::eof()
 
 int LibRaw_file_datastream::seek(INT64 o, int whence) 
 { 
+    count_seek(whence == SEEK_SET ? tell() : 0, o, whence);
     if(substream) return substream->seek(o,whence);
     LR_STREAM_CHK(); 
     std::ios_base::seekdir dir;
@@ -188,19 +326,44 @@ LibRaw_buffer_datastream::~LibRaw_buffer_datastream(){}
 
 int LibRaw_buffer_datastream::read(void * ptr,size_t sz, size_t nmemb)
 { 
-    if(substream) return substream->read(ptr,sz,nmemb);
-    size_t to_read = sz*nmemb;
-    if(to_read > streamsize - streampos)
-        to_read = streamsize-streampos;
-    if(to_read<1) 
-        return 0;
-    memmove(ptr,buf+streampos,to_read);
-    streampos+=to_read;
-    return int((to_read+sz-1)/sz);
+    int ret = 0;
+    if(substream) 
+        ret = substream->read(ptr,sz,nmemb);
+    else
+        {
+            size_t to_read = sz*nmemb;
+            if(to_read > streamsize - streampos)
+                to_read = streamsize-streampos;
+            if(to_read>0) 
+                {
+                    memmove(ptr,buf+streampos,to_read);
+                    streampos+=to_read;
+                    ret = int((to_read+sz-1)/sz);
+                }
+        }
+    count_read(INT64(ret)*sz);
+    return ret;
+}
+
+int LibRaw_buffer_datastream::read_at(INT64 offset, void *ptr, size_t sz)
+{
+    int ret = 0;
+    if(substream) 
+        ret = substream->read_at(offset,ptr,sz);
+    else if(offset >= 0 && size_t(offset) < streamsize)
+        {
+            if(sz > streamsize - size_t(offset))
+                sz = streamsize - size_t(offset);
+            memmove(ptr,buf+offset,sz);
+            ret = int(sz);
+        }
+    count_read(ret);
+    return ret;
 }
 
 int LibRaw_buffer_datastream::seek(INT64 o, int whence)
 { 
+    count_seek(tell(),o,whence);
     if(substream) return substream->seek(o,whence);
     switch(whence)
         {
@@ -304,6 +467,7 @@ int LibRaw_buffer_datastream::scanf_one(const char *fmt, void* val)
 LibRaw_byte_buffer *LibRaw_buffer_datastream::make_byte_buffer(unsigned int sz)
 {
     LibRaw_byte_buffer *ret = new LibRaw_byte_buffer(0);
+    iostats.bytebuffer_bytes += sz;
     if(streampos + sz > streamsize)
         sz = streamsize - streampos;
     ret->set_buffer(buf+streampos,sz);
@@ -356,7 +520,9 @@ int         LibRaw_bigfile_datastream::valid() { return f?1:0;}
 int LibRaw_bigfile_datastream::read(void * ptr,size_t size, size_t nmemb) 
 { 
     LR_BF_CHK(); 
-    return substream?substream->read(ptr,size,nmemb):int(fread(ptr,size,nmemb,f));
+    int ret = substream ? substream->read(ptr,size,nmemb) : int(fread(ptr,size,nmemb,f));
+    count_read(INT64(ret)*size);
+    return ret;
 }
 
 int LibRaw_bigfile_datastream::eof()
@@ -368,6 +534,7 @@ int LibRaw_bigfile_datastream::eof()
 int     LibRaw_bigfile_datastream:: seek(INT64 o, int whence)
 { 
     LR_BF_CHK(); 
+    count_seek(whence == SEEK_SET ? tell() : 0, o, whence);
 #if defined (WIN32) 
 #ifdef WIN32SECURECALLS
     return substream?substream->seek(o,whence):_fseeki64(f,o,whence);
@@ -443,6 +610,15 @@ void LibRaw_bigfile_datastream::subfile_close()
     sav = 0;
 }
 
+void LibRaw_bigfile_datastream::sequential_hint(INT64 offset)
+{
+#if !defined(WIN32) && defined(POSIX_FADV_SEQUENTIAL)
+    if(!f || sav || substream) return;
+    int fd = fileno(f);
+    posix_fadvise(fd,offset,0,POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd,offset,LIBRAW_FD_DATASTREAM_READAHEAD,POSIX_FADV_WILLNEED);
+#endif
+}
 
 void *LibRaw_bigfile_datastream::make_jas_stream()
 {
@@ -453,6 +629,605 @@ void *LibRaw_bigfile_datastream::make_jas_stream()
 #endif
 }
 
+// == LibRaw_mmap_datastream
+#ifdef LIBRAW_USE_MMAP_DATASTREAM
+
+void* LibRaw_mmap_datastream::map_file(const char *fn, size_t *sz)
+{
+    *sz = 0;
+    if(!fn) return NULL;
+    int fd = open(fn,O_RDONLY);
+    if(fd < 0) return NULL;
+    struct stat st;
+    void *ptr = NULL;
+    if(!fstat(fd,&st) && st.st_size > 0)
+        {
+            ptr = mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+            if(ptr == MAP_FAILED)
+                ptr = NULL;
+            else
+                *sz = (size_t)st.st_size;
+        }
+    close(fd); // mapping stays valid after close
+    return ptr;
+}
+
+LibRaw_mmap_datastream::LibRaw_mmap_datastream(const char *fname)
+    : LibRaw_buffer_datastream(NULL,0), filename(fname),
+      saved_buf(NULL), saved_pos(0), saved_size(0)
+{
+    buf = (unsigned char*)map_file(fname,&streamsize);
+}
+
+LibRaw_mmap_datastream::~LibRaw_mmap_datastream()
+{
+    if(saved_buf)
+        {
+            munmap(buf,streamsize);
+            buf = saved_buf; streamsize = saved_size;
+        }
+    if(buf)
+        munmap(buf,streamsize);
+}
+
+int LibRaw_mmap_datastream::scanf_one(const char *fmt, void* val)
+{
+    if(substream) return substream->scanf_one(fmt,val);
+    // mapping is not zero-terminated, so scan a local copy
+    char str[32];
+    int scanf_res;
+    if(streampos>=streamsize) return EOF;
+    size_t len = streamsize - streampos;
+    if(len > sizeof(str)-1) len = sizeof(str)-1;
+    memmove(str,buf+streampos,len);
+    str[len]=0;
+    scanf_res = sscanf(str,fmt,val);
+    if(scanf_res>0)
+        {
+            int xcnt=0;
+            while(streampos<streamsize)
+                {
+                    streampos++;
+                    xcnt++;
+                    if(streampos>=streamsize
+                       || buf[streampos] == 0
+                       || buf[streampos]==' '
+                       || buf[streampos]=='\t'
+                       || buf[streampos]=='\n'
+                       || xcnt>24)
+                        break;
+                }
+        }
+    return scanf_res;
+}
+
+const char* LibRaw_mmap_datastream::fname()
+{
+    return filename;
+}
+
+int LibRaw_mmap_datastream::subfile_open(const char *fn)
+{
+    if(saved_buf) return EBUSY;
+    size_t sz;
+    unsigned char *p = (unsigned char*)map_file(fn,&sz);
+    if(!p) return ENOENT;
+    saved_buf = buf; saved_pos = streampos; saved_size = streamsize;
+    buf = p; streampos = 0; streamsize = sz;
+    return 0;
+}
+
+void LibRaw_mmap_datastream::subfile_close()
+{
+    if(!saved_buf) return;
+    munmap(buf,streamsize);
+    buf = saved_buf; streampos = saved_pos; streamsize = saved_size;
+    saved_buf = NULL;
+}
+
+void LibRaw_mmap_datastream::sequential_hint(INT64 offset)
+{
+    if(!buf || saved_buf || substream || offset < 0 || size_t(offset) >= streamsize)
+        return;
+    size_t start = size_t(offset) & ~size_t(sysconf(_SC_PAGESIZE)-1);
+    madvise(buf+start,streamsize-start,MADV_SEQUENTIAL);
+    madvise(buf+start,streamsize-start,MADV_WILLNEED);
+}
+
+void *LibRaw_mmap_datastream::make_jas_stream()
+{
+#ifdef NO_JASPER
+    return NULL;
+#else
+    return jas_stream_fopen(fname(),"rb");
+#endif
+}
+
+#endif
+
+// == LibRaw_fd_datastream
+#ifndef WIN32
+
+static ssize_t pread_full(int fd, void *ptr, size_t sz, INT64 offset)
+{
+    size_t done = 0;
+    while(done < sz)
+        {
+            ssize_t r = pread(fd,(char*)ptr+done,sz-done,(off_t)(offset+done));
+            if(r < 0 && errno == EINTR)
+                continue;
+            if(r <= 0)
+                break;
+            done += r;
+        }
+    return done;
+}
+
+LibRaw_fd_datastream::LibRaw_fd_datastream(int _fd)
+    : fd(_fd),pos(0),fsize(0),bufdata(NULL),bufstart(0),buflen(0),readahead_pos(-1)
+{
+    struct stat st;
+    if(fd < 0 || fstat(fd,&st))
+        {
+            fd = -1;
+            return;
+        }
+    fsize = st.st_size;
+    bufdata = (unsigned char*)malloc(LIBRAW_FD_DATASTREAM_BUFSIZE);
+}
+
+LibRaw_fd_datastream::~LibRaw_fd_datastream()
+{
+    if(bufdata) free(bufdata);
+}
+
+int LibRaw_fd_datastream::valid()
+{
+    return (fd >= 0 && bufdata)?1:0;
+}
+
+#define LR_FD_CHK() do {if(fd<0 || !bufdata) throw LIBRAW_EXCEPTION_IO_EOF;}while(0)
+
+void LibRaw_fd_datastream::readahead()
+{
+#ifdef POSIX_FADV_WILLNEED
+    // keep kernel read-ahead one window in front of current position
+    if(readahead_pos >= 0 && readahead_pos < fsize
+       && pos + LIBRAW_FD_DATASTREAM_READAHEAD/2 >= readahead_pos)
+        {
+            if(readahead_pos < pos) readahead_pos = pos;
+            posix_fadvise(fd,readahead_pos,LIBRAW_FD_DATASTREAM_READAHEAD,POSIX_FADV_WILLNEED);
+            readahead_pos += LIBRAW_FD_DATASTREAM_READAHEAD;
+        }
+#endif
+}
+
+void LibRaw_fd_datastream::sequential_hint(INT64 offset)
+{
+    if(fd < 0 || substream) return;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd,offset,0,POSIX_FADV_SEQUENTIAL);
+    readahead_pos = offset;
+    readahead();
+#endif
+}
+
+int LibRaw_fd_datastream::fill_buffer()
+{
+    readahead();
+    bufstart = pos;
+    buflen = pread_full(fd,bufdata,LIBRAW_FD_DATASTREAM_BUFSIZE,pos);
+    return int(buflen);
+}
+
+int LibRaw_fd_datastream::read(void * ptr,size_t size, size_t nmemb)
+{
+    LR_FD_CHK();
+    int ret = substream ? substream->read(ptr,size,nmemb) : fd_read(ptr,size,nmemb);
+    count_read(INT64(ret)*size);
+    return ret;
+}
+
+int LibRaw_fd_datastream::fd_read(void * ptr,size_t size, size_t nmemb)
+{
+    size_t to_read = size*nmemb, done = 0;
+    if(!to_read) return 0;
+    // serve from buffer first
+    if(pos >= bufstart && pos < bufstart + (INT64)buflen)
+        {
+            size_t avail = size_t(bufstart + buflen - pos);
+            done = avail < to_read ? avail : to_read;
+            memmove(ptr,bufdata+(pos-bufstart),done);
+            pos += done;
+        }
+    if(done < to_read)
+        {
+            size_t rest = to_read - done;
+            if(rest < LIBRAW_FD_DATASTREAM_BUFSIZE)
+                {
+                    size_t got = fill_buffer();
+                    if(got > rest) got = rest;
+                    memmove((char*)ptr+done,bufdata,got);
+                    done += got;
+                    pos += got;
+                }
+            else
+                {
+                    // large reads go directly to the caller buffer
+                    readahead();
+                    size_t got = pread_full(fd,(char*)ptr+done,rest,pos);
+                    done += got;
+                    pos += got;
+                }
+        }
+    return int(done/size);
+}
+
+int LibRaw_fd_datastream::read_at(INT64 offset, void *ptr, size_t sz)
+{
+    LR_FD_CHK();
+    int ret = 0;
+    if(substream) 
+        ret = substream->read_at(offset,ptr,sz);
+    else if(offset >= 0)
+        ret = int(pread_full(fd,ptr,sz,offset));
+    count_read(ret);
+    return ret;
+}
+
+int LibRaw_fd_datastream::eof()
+{
+    LR_FD_CHK();
+    if(substream) return substream->eof();
+    return pos >= fsize;
+}
+
+int LibRaw_fd_datastream::seek(INT64 o, int whence)
+{
+    LR_FD_CHK();
+    count_seek(tell(),o,whence);
+    if(substream) return substream->seek(o,whence);
+    switch(whence)
+        {
+        case SEEK_SET:
+            pos = o;
+            break;
+        case SEEK_CUR:
+            pos += o;
+            break;
+        case SEEK_END:
+            pos = fsize + o;
+            break;
+        default:
+            return 0;
+        }
+    if(pos < 0) pos = 0;
+    return 0;
+}
+
+INT64 LibRaw_fd_datastream::tell()
+{
+    LR_FD_CHK();
+    if(substream) return substream->tell();
+    return pos;
+}
+
+char* LibRaw_fd_datastream::gets(char *str, int sz)
+{
+    LR_FD_CHK();
+    if(substream) return substream->gets(str,sz);
+    if(sz < 1) return NULL;
+    int i = 0, c = 0;
+    while(i < sz-1 && (c = get_char()) >= 0)
+        {
+            str[i++] = (char)c;
+            if(c == '\n')
+                break;
+        }
+    str[i] = 0;
+    return i ? str : NULL;
+}
+
+int LibRaw_fd_datastream::scanf_one(const char *fmt, void* val)
+{
+    LR_FD_CHK();
+    if(substream) return substream->scanf_one(fmt,val);
+    char str[32];
+    int len = int(pread_full(fd,str,sizeof(str)-1,pos));
+    if(len < 1) return EOF;
+    str[len] = 0;
+    int scanf_res = sscanf(str,fmt,val);
+    if(scanf_res>0)
+        {
+            int xcnt=0;
+            while(xcnt < len)
+                {
+                    xcnt++;
+                    if(xcnt>=len
+                       || str[xcnt] == 0
+                       || str[xcnt]==' '
+                       || str[xcnt]=='\t'
+                       || str[xcnt]=='\n'
+                       || xcnt>24)
+                        break;
+                }
+            pos += xcnt;
+        }
+    return scanf_res;
+}
+
+void *LibRaw_fd_datastream::make_jas_stream()
+{
+#ifdef NO_JASPER
+    return NULL;
+#else
+    return jas_stream_fdopen(fd,"rb");
+#endif
+}
+
+#endif
+
+// == LibRaw_cached_datastream
+
+#define CACHE_BS LIBRAW_CACHED_DATASTREAM_BLOCKSIZE
+
+LibRaw_cached_datastream::LibRaw_cached_datastream(LibRaw_abstract_datastream *p, int own, unsigned nb)
+    : parent(p),own_parent(own),nblocks(nb?nb:1),lru_clock(0),cur(-1),
+      pos(0),fsize(0),saved_pos(-1),saved_fsize(0),hits(0),misses(0)
+{
+    blk_data = (unsigned char*)malloc(size_t(nblocks)*CACHE_BS);
+    blk_offset = (INT64*)malloc(nblocks*sizeof(blk_offset[0]));
+    blk_len = (size_t*)malloc(nblocks*sizeof(blk_len[0]));
+    blk_used = (unsigned*)malloc(nblocks*sizeof(blk_used[0]));
+    if(blk_offset && blk_len && blk_used)
+        cache_flush();
+    if(parent && parent->valid())
+        fsize = parent_size();
+}
+
+LibRaw_cached_datastream::~LibRaw_cached_datastream()
+{
+    if(blk_data) free(blk_data);
+    if(blk_offset) free(blk_offset);
+    if(blk_len) free(blk_len);
+    if(blk_used) free(blk_used);
+    if(own_parent && parent) delete parent;
+}
+
+int LibRaw_cached_datastream::valid()
+{
+    return (parent && blk_data && blk_offset && blk_len && blk_used && parent->valid())?1:0;
+}
+
+#define LR_CACHE_CHK() do {if(!blk_data || !parent) throw LIBRAW_EXCEPTION_IO_EOF;}while(0)
+
+INT64 LibRaw_cached_datastream::parent_size()
+{
+    INT64 save = parent->tell();
+    parent->seek(0,SEEK_END);
+    INT64 sz = parent->tell();
+    parent->seek(save,SEEK_SET);
+    return sz;
+}
+
+void LibRaw_cached_datastream::cache_flush()
+{
+    for(unsigned i=0; i < nblocks; i++)
+        {
+            blk_offset[i] = -1;
+            blk_len[i] = 0;
+            blk_used[i] = 0;
+        }
+    cur = -1;
+}
+
+int LibRaw_cached_datastream::find_block(INT64 offset)
+{
+    if(offset < 0 || offset >= fsize)
+        return -1;
+    INT64 boff = offset & ~INT64(CACHE_BS-1);
+    unsigned i, victim = 0;
+    for(i=0; i < nblocks; i++)
+        {
+            if(blk_offset[i] == boff)
+                {
+                    hits++;
+                    blk_used[i] = ++lru_clock;
+                    return cur = i;
+                }
+            if(blk_used[i] < blk_used[victim])
+                victim = i;
+        }
+    misses++;
+    int got = parent->read_at(boff,blk_data+victim*(size_t)CACHE_BS,CACHE_BS);
+    if(got <= 0)
+        {
+            blk_offset[victim] = -1;
+            blk_len[victim] = 0;
+            blk_used[victim] = 0;
+            return cur = -1;
+        }
+    blk_offset[victim] = boff;
+    blk_len[victim] = got;
+    blk_used[victim] = ++lru_clock;
+    return cur = victim;
+}
+
+int LibRaw_cached_datastream::cached_read(INT64 offset, void *ptr, size_t sz)
+{
+    size_t done = 0;
+    while(done < sz && offset < fsize)
+        {
+            size_t rest = sz - done;
+            if(!(offset & (CACHE_BS-1)) && rest >= CACHE_BS)
+                {
+                    // large aligned read: bypass cache
+                    int got = parent->read_at(offset,(char*)ptr+done,rest & ~size_t(CACHE_BS-1));
+                    if(got <= 0) break;
+                    done += got;
+                    offset += got;
+                    continue;
+                }
+            int b = find_block(offset);
+            if(b < 0) break;
+            size_t inblk = size_t(offset - blk_offset[b]);
+            if(inblk >= blk_len[b]) break;
+            size_t n = blk_len[b] - inblk;
+            if(n > rest) n = rest;
+            memmove((char*)ptr+done,blk_data+b*(size_t)CACHE_BS+inblk,n);
+            done += n;
+            offset += n;
+        }
+    return int(done);
+}
+
+int LibRaw_cached_datastream::read_at(INT64 offset, void *ptr, size_t sz)
+{
+    LR_CACHE_CHK();
+    int ret = substream ? substream->read_at(offset,ptr,sz) : cached_read(offset,ptr,sz);
+    count_read(ret);
+    return ret;
+}
+
+int LibRaw_cached_datastream::read(void * ptr,size_t size, size_t nmemb)
+{
+    LR_CACHE_CHK();
+    int ret = 0;
+    if(substream) 
+        ret = substream->read(ptr,size,nmemb);
+    else if(size)
+        {
+            int got = cached_read(pos,ptr,size*nmemb);
+            pos += got;
+            ret = int(got/size);
+        }
+    count_read(INT64(ret)*size);
+    return ret;
+}
+
+int LibRaw_cached_datastream::eof()
+{
+    LR_CACHE_CHK();
+    if(substream) return substream->eof();
+    return pos >= fsize;
+}
+
+int LibRaw_cached_datastream::seek(INT64 o, int whence)
+{
+    LR_CACHE_CHK();
+    count_seek(tell(),o,whence);
+    if(substream) return substream->seek(o,whence);
+    switch(whence)
+        {
+        case SEEK_SET:
+            pos = o;
+            break;
+        case SEEK_CUR:
+            pos += o;
+            break;
+        case SEEK_END:
+            pos = fsize + o;
+            break;
+        default:
+            return 0;
+        }
+    if(pos < 0) pos = 0;
+    return 0;
+}
+
+INT64 LibRaw_cached_datastream::tell()
+{
+    LR_CACHE_CHK();
+    if(substream) return substream->tell();
+    return pos;
+}
+
+char* LibRaw_cached_datastream::gets(char *str, int sz)
+{
+    LR_CACHE_CHK();
+    if(substream) return substream->gets(str,sz);
+    if(sz < 1) return NULL;
+    int i = 0, c = 0;
+    while(i < sz-1 && (c = get_char()) >= 0)
+        {
+            str[i++] = (char)c;
+            if(c == '\n')
+                break;
+        }
+    str[i] = 0;
+    return i ? str : NULL;
+}
+
+int LibRaw_cached_datastream::scanf_one(const char *fmt, void* val)
+{
+    LR_CACHE_CHK();
+    if(substream) return substream->scanf_one(fmt,val);
+    char str[32];
+    int len = cached_read(pos,str,sizeof(str)-1);
+    if(len < 1) return EOF;
+    str[len] = 0;
+    int scanf_res = sscanf(str,fmt,val);
+    if(scanf_res>0)
+        {
+            int xcnt=0;
+            while(xcnt < len)
+                {
+                    xcnt++;
+                    if(xcnt>=len
+                       || str[xcnt] == 0
+                       || str[xcnt]==' '
+                       || str[xcnt]=='\t'
+                       || str[xcnt]=='\n'
+                       || xcnt>24)
+                        break;
+                }
+            pos += xcnt;
+        }
+    return scanf_res;
+}
+
+const char* LibRaw_cached_datastream::fname()
+{
+    return parent?parent->fname():NULL;
+}
+
+int LibRaw_cached_datastream::subfile_open(const char *fn)
+{
+    LR_CACHE_CHK();
+    if(saved_pos >= 0) return EBUSY;
+    int ret = parent->subfile_open(fn);
+    if(ret) return ret;
+    saved_pos = pos;
+    saved_fsize = fsize;
+    pos = 0;
+    fsize = parent_size();
+    cache_flush();
+    return 0;
+}
+
+void LibRaw_cached_datastream::subfile_close()
+{
+    if(!parent || saved_pos < 0) return;
+    parent->subfile_close();
+    pos = saved_pos;
+    fsize = saved_fsize;
+    saved_pos = -1;
+    cache_flush();
+}
+
+void LibRaw_cached_datastream::sequential_hint(INT64 offset)
+{
+    if(parent && !substream)
+        parent->sequential_hint(offset);
+}
+
+void *LibRaw_cached_datastream::make_jas_stream()
+{
+    return parent?parent->make_jas_stream():NULL;
+}
+
+#undef CACHE_BS
+
 // == LibRaw_windows_datastream
 #ifdef WIN32
 